@@ -1,19 +1,99 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <csignal>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <cmath>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HW4_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#define HW4_HAVE_INOTIFY 1
+#include <poll.h>
+#include <sys/inotify.h>
+#define HW4_HAVE_PERF_EVENTS 1
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define HW4_HAVE_ZERO_COPY 1
+#include <sys/sendfile.h>
+#endif
+
+// Trace spans are compiled in unless built with HW4_TRACING=0, and record only while a
+// TraceRecorder is active.
+#ifndef HW4_TRACING
+#define HW4_TRACING 1
+#endif
+
+// gzip sources and outputs need zlib (HW4_HAVE_ZLIB=1, set by CMake when zlib is found).
+#ifndef HW4_HAVE_ZLIB
+#define HW4_HAVE_ZLIB 0
+#endif
+#if HW4_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// Built with HW4_BENCHMARK=1 (the hw4_bench target), main() runs the benchmark suite.
+#ifndef HW4_BENCHMARK
+#define HW4_BENCHMARK 0
+#endif
 
 using namespace std;
 
+// Storage always holds one byte past capacity so the contents stay NUL-terminated for the
+// transforms that scan them as C strings.
 class CustomVector {
     char* data;
     size_t size;
     size_t capacity;
 
+    static inline atomic<uint64_t> allocationCount{0};
+    static inline atomic<size_t> largestAllocation{0};
+
+    static char* allocate(size_t newCapacity) {
+        allocationCount.fetch_add(1, memory_order_relaxed);
+        size_t largest = largestAllocation.load(memory_order_relaxed);
+        while (newCapacity > largest &&
+               !largestAllocation.compare_exchange_weak(largest, newCapacity, memory_order_relaxed)) {
+        }
+        return new char[newCapacity + 1];
+    }
+
     void copyFrom(const CustomVector& other) {
         if (other.data) {
-            data = new char[other.capacity];
+            data = allocate(other.capacity);
             copy(other.data, other.data + other.size, data);
+            data[other.size] = '\0';
         }
         size = other.size;
         capacity = other.capacity;
@@ -47,7 +127,7 @@ public:
     void push_back(char c) {
         if (size == capacity) {
             size_t newCapacity = (capacity == 0) ? 1 : capacity * 2;
-            char* newData = new char[newCapacity];
+            char* newData = allocate(newCapacity);
             if (data) {
                 for (size_t i = 0; i < size; ++i) {
                     newData[i] = data[i];
@@ -58,16 +138,53 @@ public:
             capacity = newCapacity;
         }
         data[size++] = c;
+        data[size] = '\0';
+    }
+
+    void reserve(size_t newCapacity) {
+        if (newCapacity <= capacity) {
+            return;
+        }
+        char* newData = allocate(newCapacity);
+        if (data) {
+            copy(data, data + size, newData);
+            delete[] data;
+        }
+        data = newData;
+        data[size] = '\0';
+        capacity = newCapacity;
+    }
+
+    void append(const char* bytes, size_t length) {
+        if (length == 0) {
+            return;
+        }
+        if (size + length > capacity) {
+            reserve(max(size + length, capacity * 2));
+        }
+        copy(bytes, bytes + length, data + size);
+        size += length;
+        data[size] = '\0';
     }
 
     void resize(size_t newSize) {
         if (newSize < size) {
             size = newSize;
+            data[size] = '\0';
         }
     }
 
     void clear() {
         size = 0;
+        if (data) {
+            data[0] = '\0';
+        }
+    }
+
+    void swap(CustomVector& other) {
+        std::swap(data, other.data);
+        std::swap(size, other.size);
+        std::swap(capacity, other.capacity);
     }
 
     size_t getSize() const {
@@ -78,6 +195,19 @@ public:
         return data;
     }
 
+    // Process-wide buffer allocation statistics, for profiling.
+    static uint64_t getAllocationCount() {
+        return allocationCount.load(memory_order_relaxed);
+    }
+
+    static size_t getLargestAllocation() {
+        return largestAllocation.load(memory_order_relaxed);
+    }
+
+    static void resetLargestAllocation() {
+        largestAllocation.store(0, memory_order_relaxed);
+    }
+
     char& operator[](size_t index) {
         if (index >= size) {
             throw out_of_range("Index out of range");
@@ -142,7 +272,7 @@ public:
         }
         if (size == capacity) {
             size_t newCapacity = (capacity == 0) ? 1 : capacity * 2;
-            char* newData = new char[newCapacity];
+            char* newData = allocate(newCapacity);
             for (size_t i = 0; i < index; ++i) {
                 newData[i] = data[i];
             }
@@ -161,516 +291,5647 @@ public:
             data[index] = value;
             ++size;
         }
+        data[size] = '\0';
     }
 };
 
-class TextSource {
-public:
-    TextSource() = default;
+static uint64_t mixHash(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
 
-    virtual void readData() = 0;
-    virtual char* getData() = 0;
-};
+static uint64_t hashBytes(const char* bytes, size_t length, uint64_t seed = 0) {
+    const uint64_t multiplier = 0x9e3779b97f4a7c15ULL;
+    uint64_t h = seed ^ (length * multiplier);
+    size_t i = 0;
 
-class TextFileSource : public TextSource {
-    const char* fileName;
-    CustomVector buffer;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        h = (h ^ mixHash(word)) * multiplier;
+        h = (h << 27) | (h >> 37);
+    }
+    uint64_t tail = 0;
+    for (size_t shift = 0; i < length; ++i, shift += 8) {
+        tail |= static_cast<uint64_t>(static_cast<unsigned char>(bytes[i])) << shift;
+    }
+    return mixHash(h ^ mixHash(tail));
+}
+
+static size_t textLength(const CustomVector& data) {
+    if (!data.getData()) {
+        return 0;
+    }
+    const void* terminator = memchr(data.getData(), '\0', data.getSize());
+    return terminator ? static_cast<const char*>(terminator) - data.getData() : data.getSize();
+}
+
+static int countLeadingZeros(uint64_t value) {
+    if (value == 0) {
+        return 64;
+    }
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_clzll(value);
+#else
+    int count = 0;
+    while (!(value & (1ULL << 63))) {
+        value <<= 1;
+        count++;
+    }
+    return count;
+#endif
+}
+
+// Read-only view of a whole file: memory-mapped where the platform allows it, read into
+// memory otherwise.
+class MappedFile {
+    const char* bytes;
+    size_t length;
+    bool mapped;
+    CustomVector fallback;
 public:
-    TextFileSource() = delete;
-    explicit TextFileSource(const char* fileName) : TextSource(), fileName(fileName) {};
+    MappedFile() : bytes(nullptr), length(0), mapped(false) {}
 
-    void readData() override {
-        ifstream inputFile(fileName);
+    MappedFile(const MappedFile& other) = delete;
+    MappedFile& operator=(const MappedFile& other) = delete;
+
+    ~MappedFile() {
+        close();
+    }
 
+    bool open(const char* fileName) {
+        close();
+#ifdef HW4_HAVE_MMAP
+        int fd = ::open(fileName, O_RDONLY);
+        if (fd < 0) {
+            cerr << "Failed to open the file." << endl;
+            return false;
+        }
+        bool opened = open(fd);
+        ::close(fd);
+        if (opened) {
+            return true;
+        }
+#endif
+        ifstream inputFile(fileName, ios::binary);
         if (!inputFile) {
             cerr << "Failed to open the file." << endl;
-            return;
+            return false;
         }
-
-        char inputChar;
-        while (inputFile.get(inputChar)) {
-            buffer.push_back(inputChar);
+        char block[1 << 16];
+        while (inputFile.read(block, sizeof(block)) || inputFile.gcount() > 0) {
+            fallback.append(block, inputFile.gcount());
         }
+        bytes = fallback.getData();
+        length = fallback.getSize();
+        return true;
+    }
 
-        if (buffer.getSize() > 0) {
-            buffer.push_back('\0');
+#ifdef HW4_HAVE_MMAP
+    // Maps a file that is already open, reading it if it cannot be mapped. The descriptor
+    // stays the caller's.
+    bool open(int fd) {
+        close();
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            return false;
         }
+        if (info.st_size == 0) {
+            return true;
+        }
+        void* region = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (region != MAP_FAILED) {
+            bytes = static_cast<const char*>(region);
+            length = info.st_size;
+            mapped = true;
+            return true;
+        }
+        char block[1 << 16];
+        ssize_t got;
+        while ((got = pread(fd, block, sizeof(block), static_cast<off_t>(fallback.getSize()))) > 0) {
+            fallback.append(block, static_cast<size_t>(got));
+        }
+        bytes = fallback.getData();
+        length = fallback.getSize();
+        return got == 0;
     }
+#endif
 
-    char* getData() override {
-        return buffer.getData();
+    void close() {
+#ifdef HW4_HAVE_MMAP
+        if (mapped) {
+            munmap(const_cast<char*>(bytes), length);
+        }
+#endif
+        bytes = nullptr;
+        length = 0;
+        mapped = false;
+        fallback.clear();
     }
-};
 
-class TextConsoleSource : public TextSource {
-    CustomVector data;
-public:
-    TextConsoleSource() : TextSource() {};
+    const char* getData() const {
+        return bytes;
+    }
 
-    void readData() override {
-        char inputChar;
+    size_t getSize() const {
+        return length;
+    }
+};
 
-        cout << "Enter characters: ";
+// Copies length bytes of a file, from sourceOffset, to targetFd without passing them through
+// user space where the kernel allows it: copy_file_range between regular files, sendfile to
+// anything else, plain reads and writes as the last resort. targetOffset is where to write in
+// a regular file, or appendAtPosition to write at the target's current position (a pipe or
+// terminal). Returns the number of bytes copied, which is less than length on an error.
+static constexpr uint64_t appendAtPosition = UINT64_MAX;
 
-        data.clear();
+#ifdef HW4_HAVE_MMAP
+static constexpr bool fileCopySupported = true;
+#else
+static constexpr bool fileCopySupported = false;
+#endif
 
-        while (cin.get(inputChar) && inputChar != '\n') {
-            data.push_back(inputChar);
+static uint64_t copyFileBytes(int sourceFd, uint64_t sourceOffset, int targetFd, uint64_t targetOffset, uint64_t length) {
+    uint64_t copied = 0;
+#ifdef HW4_HAVE_ZERO_COPY
+    if (targetOffset != appendAtPosition) {
+        while (copied < length) {
+            loff_t in = static_cast<loff_t>(sourceOffset + copied);
+            loff_t out = static_cast<loff_t>(targetOffset + copied);
+            ssize_t n = copy_file_range(sourceFd, &in, targetFd, &out, length - copied, 0);
+            if (n <= 0) {
+                break;
+            }
+            copied += n;
         }
-        data.push_back('\0');
     }
-
-    char* getData() override {
-        return data.getData();
+    if (copied < length && (targetOffset == appendAtPosition ||
+                            lseek(targetFd, static_cast<off_t>(targetOffset + copied), SEEK_SET) >= 0)) {
+        while (copied < length) {
+            off_t in = static_cast<off_t>(sourceOffset + copied);
+            ssize_t n = sendfile(targetFd, sourceFd, &in, min<uint64_t>(length - copied, 1 << 30));
+            if (n <= 0) {
+                break;
+            }
+            copied += n;
+        }
     }
-};
+#endif
+#ifdef HW4_HAVE_MMAP
+    char block[1 << 16];
+    while (copied < length) {
+        ssize_t n = pread(sourceFd, block, min<uint64_t>(sizeof(block), length - copied),
+                          static_cast<off_t>(sourceOffset + copied));
+        if (n <= 0) {
+            break;
+        }
+        ssize_t written = 0;
+        while (written < n) {
+            ssize_t w = (targetOffset == appendAtPosition)
+                            ? write(targetFd, block + written, n - written)
+                            : pwrite(targetFd, block + written, n - written,
+                                     static_cast<off_t>(targetOffset + copied + written));
+            if (w <= 0) {
+                return copied + written;
+            }
+            written += w;
+        }
+        copied += n;
+    }
+#endif
+    return copied;
+}
 
-class TextTransform {
-protected:
-    static const int maxLines = 1000;
-    static const int maxLineLen = 1000;
+// Editable text for transforms that insert or erase in the middle: unlike CustomVector,
+// an edit does not shift the bytes after it. materialize() produces the text once the
+// edits are done.
+class TextBuffer {
 public:
-    explicit TextTransform() = default;
+    virtual ~TextBuffer() = default;
 
-    virtual void apply(CustomVector& data) = 0;
+    virtual size_t getSize() const = 0;
+
+    virtual char at(size_t offset) const = 0;
+
+    virtual void insert(size_t offset, const char* bytes, size_t length) = 0;
+
+    virtual void erase(size_t offset, size_t length) = 0;
+
+    // Replaces the contents of out with the whole text.
+    virtual void materialize(CustomVector& out) const = 0;
 };
 
-class RemoveString : public TextTransform {
-    const char* strToRemove;
-public:
-    explicit RemoveString(const char* strToRemove) : strToRemove(strToRemove) {}
+// Piece table: the text is a sequence of pieces, each a range of the original text or of an
+// append-only buffer of inserted bytes. The pieces are kept in a treap ordered by position,
+// so locating an offset, inserting and erasing take O(log n) expected time in the number of
+// pieces, and no byte is moved after it is stored. Consecutive reads within one piece are
+// served from the last piece found, so scanning the text is O(1) per byte.
+// After indexLines() every piece also counts its line breaks, found by binary search in the
+// sorted newline offsets of its buffer, so lines can be located in O(log n) after any edits.
+class PieceTable : public TextBuffer {
+    struct Piece {
+        size_t start;
+        size_t length;
+        size_t subtreeLength;
+        size_t lineBreaks;
+        size_t subtreeLineBreaks;
+        uint32_t priority;
+        int left;
+        int right;
+        bool added;
+    };
 
-    void apply(CustomVector& data) override {
-        CustomVector result;
-        char* read = data.getData();
+    CustomVector ownedOriginal;
+    const char* original;
+    size_t originalSize;
+    CustomVector added;
+    vector<Piece> pieces;
+    vector<int> freePieces;
+    int root = -1;
+    bool linesIndexed = false;
+    vector<size_t> originalBreaks;
+    vector<size_t> addedBreaks;
+    uint32_t randomState = 2463534242u;
 
-        while (*read) {
-            char* match = strstr(read, strToRemove);
+    mutable size_t cachedBegin = 0;
+    mutable size_t cachedEnd = 0;
+    mutable const char* cachedBytes = nullptr;
 
-            if (match) {
-                size_t length = match - read;
-                for (size_t i = 0; i < length; ++i) {
-                    result.push_back(read[i]);
-                }
-                read = match + strlen(strToRemove);
-            } else {
-                while (*read) {
-                    result.push_back(*read);
-                    read++;
-                }
-                break;
-            }
-        }
-        data.clear();
+    uint32_t nextPriority() {
+        randomState ^= randomState << 13;
+        randomState ^= randomState >> 17;
+        randomState ^= randomState << 5;
+        return randomState;
+    }
 
-        for (size_t i = 0; i < result.getSize(); ++i) {
-            data.push_back(result[i]);
+    static void findBreaks(const char* bytes, size_t length, size_t base, vector<size_t>& breaks) {
+        if (length == 0) {
+            return;
+        }
+        const char* read = bytes;
+        const char* end = bytes + length;
+        while (const void* newline = memchr(read, '\n', end - read)) {
+            breaks.push_back(base + (static_cast<const char*>(newline) - bytes));
+            read = static_cast<const char*>(newline) + 1;
         }
     }
-};
 
-class RemoveLines : public TextTransform {
-    const char* substring;
-public:
-    explicit RemoveLines(const char* substring) : substring(substring) {}
+    const vector<size_t>& breaksOf(bool inAdded) const {
+        return inAdded ? addedBreaks : originalBreaks;
+    }
 
-    static void appendString(CustomVector& dest, const char* str) {
-        for (size_t i = 0; str[i] != '\0'; ++i) {
-            dest.push_back(str[i]);
+    size_t breaksIn(bool inAdded, size_t start, size_t length) const {
+        if (!linesIndexed) {
+            return 0;
         }
+        const vector<size_t>& breaks = breaksOf(inAdded);
+        return lower_bound(breaks.begin(), breaks.end(), start + length) -
+               lower_bound(breaks.begin(), breaks.end(), start);
     }
 
-    void apply(CustomVector& data) override {
-        int numLines = 0;
-        CustomVector result;
+    int newPiece(bool inAdded, size_t start, size_t length) {
+        size_t lineBreaks = breaksIn(inAdded, start, length);
+        Piece piece = { start, length, length, lineBreaks, lineBreaks, nextPriority(), -1, -1, inAdded };
+        if (!freePieces.empty()) {
+            int index = freePieces.back();
+            freePieces.pop_back();
+            pieces[index] = piece;
+            return index;
+        }
+        pieces.push_back(piece);
+        return static_cast<int>(pieces.size()) - 1;
+    }
 
-        char* token = strtok(data.getData(), "\n");
+    size_t lengthOf(int node) const {
+        return node < 0 ? 0 : pieces[node].subtreeLength;
+    }
 
-        while (token != nullptr && numLines < maxLines) {
-            if (strstr(token, substring) == nullptr) {
-                appendString(result, token);
-                result.push_back('\n');
-                numLines++;
-            }
-            token = strtok(nullptr, "\n");
+    size_t lineBreaksOf(int node) const {
+        return node < 0 ? 0 : pieces[node].subtreeLineBreaks;
+    }
+
+    void update(int node) {
+        Piece& piece = pieces[node];
+        piece.subtreeLength = piece.length + lengthOf(piece.left) + lengthOf(piece.right);
+        piece.subtreeLineBreaks = piece.lineBreaks + lineBreaksOf(piece.left) + lineBreaksOf(piece.right);
+    }
+
+    void recountLineBreaks(int node) {
+        if (node >= 0) {
+            recountLineBreaks(pieces[node].left);
+            recountLineBreaks(pieces[node].right);
+            pieces[node].lineBreaks = breaksIn(pieces[node].added, pieces[node].start, pieces[node].length);
+            update(node);
         }
-        data.clear();
-        data = result;
     }
-};
 
-class RemoveCharacter : public TextTransform {
-    const char charToRemove;
-public:
-    explicit RemoveCharacter(const char charToRemove) : charToRemove(charToRemove) {}
+    const char* bytesOf(const Piece& piece) const {
+        return (piece.added ? added.getData() : original) + piece.start;
+    }
 
-    void apply(CustomVector& data) override {
-        size_t read = 0;
-        size_t write = 0;
+    int merge(int left, int right) {
+        if (left < 0 || right < 0) {
+            return left < 0 ? right : left;
+        }
+        if (pieces[left].priority > pieces[right].priority) {
+            int merged = merge(pieces[left].right, right);
+            pieces[left].right = merged;
+            update(left);
+            return left;
+        }
+        int merged = merge(left, pieces[right].left);
+        pieces[right].left = merged;
+        update(right);
+        return right;
+    }
 
-        while (read < data.getSize()) {
-            if (data[read] != charToRemove) {
-                data[write] = data[read];
-                ++write;
-            }
-            ++read;
+    // Splits the tree into the first offset bytes and the rest, cutting a piece in two if
+    // the offset falls inside it.
+    void split(int node, size_t offset, int& left, int& right) {
+        if (node < 0) {
+            left = right = -1;
+            return;
+        }
+        size_t leftLength = lengthOf(pieces[node].left);
+        if (offset <= leftLength) {
+            int inner;
+            split(pieces[node].left, offset, left, inner);
+            pieces[node].left = inner;
+            update(node);
+            right = node;
+        } else if (offset >= leftLength + pieces[node].length) {
+            int inner;
+            split(pieces[node].right, offset - leftLength - pieces[node].length, inner, right);
+            pieces[node].right = inner;
+            update(node);
+            left = node;
+        } else {
+            size_t cut = offset - leftLength;
+            int tail = newPiece(pieces[node].added, pieces[node].start + cut, pieces[node].length - cut);
+            int oldRight = pieces[node].right;
+            pieces[node].length = cut;
+            pieces[node].lineBreaks = breaksIn(pieces[node].added, pieces[node].start, cut);
+            pieces[node].right = -1;
+            update(node);
+            left = node;
+            right = merge(tail, oldRight);
         }
-        data.resize(write);
     }
-};
 
-class ReplaceString : public TextTransform {
-    const char* oldStr;
-    const char* newStr;
+    void release(int node) {
+        if (node >= 0) {
+            release(pieces[node].left);
+            release(pieces[node].right);
+            freePieces.push_back(node);
+        }
+    }
+
+    void reset(const char* text, size_t length) {
+        original = text;
+        originalSize = length;
+        pieces.clear();
+        freePieces.clear();
+        linesIndexed = false;
+        originalBreaks.clear();
+        addedBreaks.clear();
+        root = (length > 0) ? newPiece(false, 0, length) : -1;
+        cachedBegin = cachedEnd = 0;
+    }
 public:
-    explicit ReplaceString(const char* oldStr, const char* newStr) : oldStr(oldStr), newStr(newStr) {}
+    // Takes over the contents of text, leaving it empty.
+    explicit PieceTable(CustomVector& text) {
+        ownedOriginal.swap(text);
+        reset(ownedOriginal.getData(), ownedOriginal.getSize());
+    }
 
-    void apply(CustomVector& data) override {
-        if (!oldStr || !newStr) {
-            return;
-        }
-        size_t oldStrLen = strlen(oldStr);
-        size_t newStrLen = strlen(newStr);
-        size_t dataSize = data.getSize();
+    // Edits a view of text, which must outlive the table (e.g. a MappedFile).
+    PieceTable(const char* text, size_t length) {
+        reset(text, length);
+    }
 
-        CustomVector result;
+    PieceTable(const PieceTable& other) = delete;
+    PieceTable& operator=(const PieceTable& other) = delete;
 
-        for (size_t i = 0; i < dataSize; ++i) {
-            if (i + oldStrLen <= dataSize) {
-                bool isMatch = true;
-                for (size_t j = 0; j < oldStrLen; ++j) {
-                    if (data[i + j] != oldStr[j]) {
-                        isMatch = false;
-                        break;
-                    }
-                }
-                if (isMatch) {
-                    for (size_t j = 0; j < newStrLen; ++j) {
-                        result.push_back(newStr[j]);
-                    }
-                    i += oldStrLen - 1;
+    size_t getSize() const override {
+        return lengthOf(root);
+    }
+
+    size_t getPieceCount() const {
+        return pieces.size() - freePieces.size();
+    }
+
+    // Not safe to call from several threads at once: reads update the piece cache.
+    char at(size_t offset) const override {
+        if (offset < cachedBegin || offset >= cachedEnd) {
+            int node = root;
+            size_t base = 0;
+            while (node >= 0) {
+                const Piece& piece = pieces[node];
+                size_t leftLength = lengthOf(piece.left);
+                if (offset < base + leftLength) {
+                    node = piece.left;
+                } else if (offset < base + leftLength + piece.length) {
+                    cachedBegin = base + leftLength;
+                    cachedEnd = cachedBegin + piece.length;
+                    cachedBytes = bytesOf(piece);
+                    break;
                 } else {
-                    result.push_back(data[i]);
+                    base += leftLength + piece.length;
+                    node = piece.right;
                 }
-            } else {
-                result.push_back(data[i]);
+            }
+            if (node < 0) {
+                throw out_of_range("Index out of range");
             }
         }
-        data.clear();
+        return cachedBytes[offset - cachedBegin];
+    }
 
-        for (size_t i = 0; i < result.getSize(); ++i) {
-            data.push_back(result[i]);
+    void insert(size_t offset, const char* bytes, size_t length) override {
+        if (offset > getSize()) {
+            throw out_of_range("Index out of range");
+        }
+        if (length == 0) {
+            return;
+        }
+        size_t start = added.getSize();
+        added.append(bytes, length);
+        if (linesIndexed) {
+            findBreaks(bytes, length, start, addedBreaks);
         }
+        int node = newPiece(true, start, length);
+        int left, right;
+        split(root, offset, left, right);
+        root = merge(merge(left, node), right);
+        cachedBegin = cachedEnd = 0;
     }
-};
 
-class RemovePunctuation : public TextTransform {
-public:
-    explicit RemovePunctuation() = default;
+    void erase(size_t offset, size_t length) override {
+        if (offset > getSize() || length > getSize() - offset) {
+            throw out_of_range("Index out of range");
+        }
+        int left, middle, right;
+        split(root, offset, left, middle);
+        split(middle, length, middle, right);
+        release(middle);
+        root = merge(left, right);
+        cachedBegin = cachedEnd = 0;
+    }
 
-    void apply(CustomVector& data) override {
-        char* read = data.getData();
-        CustomVector result;
+    // Starts counting line breaks: O(n) once for the original text, then O(length) per insert.
+    void indexLines() {
+        if (linesIndexed) {
+            return;
+        }
+        linesIndexed = true;
+        findBreaks(original, originalSize, 0, originalBreaks);
+        findBreaks(added.getData(), added.getSize(), 0, addedBreaks);
+        recountLineBreaks(root);
+    }
 
-        while (*read) {
-            if (!ispunct(*read)) {
-                result.push_back(*read);
+    // The number of lines, counting the text after the last newline as a line even when it
+    // is empty. Requires indexLines().
+    size_t getLineCount() const {
+        return lineBreaksOf(root) + 1;
+    }
+
+    // Offset of the first byte of a line (0-based), in O(log n).
+    size_t lineStart(size_t line) const {
+        if (line == 0) {
+            return 0;
+        }
+        if (line >= getLineCount()) {
+            throw out_of_range("Line out of range");
+        }
+        int node = root;
+        size_t base = 0;
+        size_t remaining = line;
+        while (node >= 0) {
+            const Piece& piece = pieces[node];
+            size_t leftBreaks = lineBreaksOf(piece.left);
+            if (remaining <= leftBreaks) {
+                node = piece.left;
+            } else if (remaining <= leftBreaks + piece.lineBreaks) {
+                const vector<size_t>& breaks = breaksOf(piece.added);
+                size_t first = lower_bound(breaks.begin(), breaks.end(), piece.start) - breaks.begin();
+                size_t newline = breaks[first + (remaining - leftBreaks - 1)];
+                return base + lengthOf(piece.left) + (newline - piece.start) + 1;
+            } else {
+                remaining -= leftBreaks + piece.lineBreaks;
+                base += lengthOf(piece.left) + piece.length;
+                node = piece.right;
             }
-            read++;
         }
-        data.clear();
+        return getSize();
+    }
 
-        for (size_t i = 0; i < result.getSize(); ++i) {
-            data.push_back(result[i]);
+    // The line (0-based) containing offset, in O(log n).
+    size_t lineOf(size_t offset) const {
+        int node = root;
+        size_t base = 0;
+        size_t lines = 0;
+        while (node >= 0) {
+            const Piece& piece = pieces[node];
+            size_t leftLength = lengthOf(piece.left);
+            if (offset < base + leftLength) {
+                node = piece.left;
+            } else if (offset < base + leftLength + piece.length) {
+                return lines + lineBreaksOf(piece.left) + breaksIn(piece.added, piece.start, offset - base - leftLength);
+            } else {
+                lines += lineBreaksOf(piece.left) + piece.lineBreaks;
+                base += leftLength + piece.length;
+                node = piece.right;
+            }
         }
+        return lines;
     }
-};
 
-class AddNewlineSentence : public TextTransform {
-public:
-    explicit AddNewlineSentence() = default;
-
-    void apply(CustomVector& data) override {
-        size_t length = data.getSize();
-        CustomVector result;
-
-        for (size_t i = 0; i < length; i++) {
-            char currChar = data[i];
-            result.push_back(currChar);
-            if (currChar == '.' || currChar == '!' || currChar == '?') {
-                if (i < length - 1) {
-                    char nextChar = data[i + 1];
-                    if (nextChar != '\n' && nextChar != '.' && nextChar != '\0') {
-                        result.push_back('\n');
-                    }
-                }
+    // Calls visit(bytes, length) for each piece in order.
+    template <typename Visitor>
+    void forEachPiece(Visitor visit) const {
+        vector<int> path;
+        int node = root;
+        while (node >= 0 || !path.empty()) {
+            while (node >= 0) {
+                path.push_back(node);
+                node = pieces[node].left;
             }
+            node = path.back();
+            path.pop_back();
+            visit(bytesOf(pieces[node]), pieces[node].length);
+            node = pieces[node].right;
         }
-        data.clear();
+    }
 
-        for (size_t i = 0; i < result.getSize(); i++) {
-            data.push_back(result[i]);
-        }
+    void materialize(CustomVector& out) const override {
+        out.clear();
+        out.reserve(getSize());
+        forEachPiece([&](const char* bytes, size_t length) {
+            out.append(bytes, length);
+        });
     }
 };
 
-class AddNewlineWord : public TextTransform {
-public:
-    explicit AddNewlineWord() = default;
+static void appendVarint(CustomVector& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
 
-    void apply(CustomVector& data) override {
-        CustomVector result;
-        bool inWord = false;
+static bool readVarint(const char*& read, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; read < end && shift < 64; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(*read++);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-        for (size_t i = 0; i < data.getSize(); ++i) {
-            char c = data[i];
-            result.push_back(c);
-            if (isspace(c)) {
-                if (inWord) {
-                    result.push_back('\n');
-                    inWord = false;
-                }
-            } else {
-                inWord = true;
+template <typename T>
+static void appendRaw(CustomVector& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+static T readRaw(const char* bytes) {
+    T value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+// Index terms are whitespace-separated words with punctuation dropped, i.e. the words that
+// RemovePunctuation followed by AddNewlineWord would leave on their own lines.
+template <typename Callback>
+static void forEachIndexTerm(const char* text, size_t length, string& term, Callback callback) {
+    size_t i = 0;
+    while (i < length) {
+        while (i < length && isspace(static_cast<unsigned char>(text[i]))) {
+            i++;
+        }
+        term.clear();
+        while (i < length && !isspace(static_cast<unsigned char>(text[i]))) {
+            if (!ispunct(static_cast<unsigned char>(text[i]))) {
+                term.push_back(text[i]);
             }
+            i++;
         }
-        data.clear();
-
-        for (size_t i = 0; i < result.getSize(); ++i) {
-            data.push_back(result[i]);
+        if (!term.empty()) {
+            callback(term);
         }
     }
+}
+
+// Compressed file formats, recognized by their first bytes.
+enum class Compression {
+    None,
+    Gzip,
+    Zstd
 };
 
-class AddNewlineMaxChars : public TextTransform {
-    int maxCharsK;
-public:
-    explicit AddNewlineMaxChars(int maxCharsK) : maxCharsK(maxCharsK) {}
+static Compression detectCompression(const char* bytes, size_t length) {
+    if (length >= 2 && static_cast<uint8_t>(bytes[0]) == 0x1f && static_cast<uint8_t>(bytes[1]) == 0x8b) {
+        return Compression::Gzip;
+    }
+    if (length >= 4 && memcmp(bytes, "\x28\xb5\x2f\xfd", 4) == 0) {
+        return Compression::Zstd;
+    }
+    return Compression::None;
+}
 
-    void apply(CustomVector& data) override {
-        size_t resIndex = 0;
-        size_t currLineLen = 0;
+// Reads a file from the start in pieces, decompressing it on the fly when its first bytes
+// identify a compressed format, so compressed input never needs a decompressed copy on disk.
+// Concatenated gzip members, as block-parallel compressors write them, read as one stream.
+class DecompressingReader {
+    ifstream input;
+    Compression compression = Compression::None;
+    bool finished = false;
+    bool failed = false;
+    char inputBlock[1 << 16];
+#if HW4_HAVE_ZLIB
+    z_stream stream;
+    bool streamOpen = false;
+#endif
 
-        for (size_t i = 0; i < data.getSize(); i++) {
-            char currentChar = data[i];
-            if (currentChar != '\n') {
-                currLineLen++;
+    bool fail(const char* message) {
+        cerr << message << endl;
+        failed = true;
+        finished = true;
+        return false;
+    }
+
+#if HW4_HAVE_ZLIB
+    bool refill() {
+        input.read(inputBlock, sizeof(inputBlock));
+        stream.next_in = reinterpret_cast<Bytef*>(inputBlock);
+        stream.avail_in = static_cast<uInt>(input.gcount());
+        return stream.avail_in > 0;
+    }
+
+    bool readGzip(CustomVector& out, size_t maxBytes) {
+        char outputBlock[1 << 16];
+        size_t produced = 0;
+        while (produced < maxBytes && !finished) {
+            if (stream.avail_in == 0 && !refill()) {
+                return fail("Truncated gzip input.");
             }
-            if (currLineLen >= static_cast<size_t>(maxCharsK)) {
-                for (size_t j = i; j > 0; j--) {
-                    if (data[j] == ' ' || data[j] == '\n') {
-                        data.insert(data.begin() + j, '\n');
-                        currLineLen = i - j;
-                        break;
-                    }
+            stream.next_out = reinterpret_cast<Bytef*>(outputBlock);
+            stream.avail_out = static_cast<uInt>(min(sizeof(outputBlock), maxBytes - produced));
+            int status = inflate(&stream, Z_NO_FLUSH);
+            size_t got = reinterpret_cast<char*>(stream.next_out) - outputBlock;
+            out.append(outputBlock, got);
+            produced += got;
+            if (status == Z_STREAM_END) {
+                // Another member may follow.
+                if (stream.avail_in == 0 && !refill()) {
+                    finished = true;
+                } else {
+                    inflateReset(&stream);
                 }
+            } else if (status != Z_OK && status != Z_BUF_ERROR) {
+                return fail("Invalid gzip input.");
             }
-            resIndex++;
         }
+        return produced > 0 || !finished;
     }
-};
-
-class RemoveNewline : public TextTransform {
+#endif
 public:
-    explicit RemoveNewline() = default;
+    DecompressingReader() = default;
 
-    void apply(CustomVector& data) override {
-        size_t resIndex = 0;
+    DecompressingReader(const DecompressingReader& other) = delete;
+    DecompressingReader& operator=(const DecompressingReader& other) = delete;
 
-        for (size_t i = 0; i < data.getSize(); i++) {
-            char currentChar = data[i];
-            if (currentChar != '\n') {
-                data[resIndex++] = currentChar;
+    ~DecompressingReader() {
+#if HW4_HAVE_ZLIB
+        if (streamOpen) {
+            inflateEnd(&stream);
+        }
+#endif
+    }
+
+    bool open(const char* fileName) {
+        input.open(fileName, ios::binary);
+        if (!input) {
+            cerr << "Failed to open the file." << endl;
+            failed = finished = true;
+            return false;
+        }
+        char magic[4];
+        input.read(magic, sizeof(magic));
+        compression = detectCompression(magic, input.gcount());
+        input.clear();
+        input.seekg(0);
+        if (compression == Compression::Zstd) {
+            return fail("zstd-compressed input is not supported by this build.");
+        }
+        if (compression == Compression::Gzip) {
+#if HW4_HAVE_ZLIB
+            memset(&stream, 0, sizeof(stream));
+            if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+                return fail("Cannot start gzip decompression.");
             }
+            streamOpen = true;
+#else
+            return fail("gzip-compressed input needs a build with zlib.");
+#endif
         }
-        data.resize(resIndex);
+        return true;
     }
-};
 
-class LexSortLines : public TextTransform {
-public:
-    explicit LexSortLines() = default;
+    Compression getCompression() const {
+        return compression;
+    }
 
-    void apply(CustomVector& data) override {
-        char lines[maxLines][maxLineLen];
-        int lineIndices[maxLines];
-        int numLines = 0;
+    bool hasFailed() const {
+        return failed;
+    }
 
-        char *token = strtok(data.getData(), "\n");
-        while (token != nullptr) {
-            strcpy(lines[numLines], token);
-            lineIndices[numLines] = numLines;
-            numLines++;
-            token = strtok(nullptr, "\n");
+    // Appends up to maxBytes of (decompressed) data to out. Returns false once there is
+    // nothing more to read.
+    bool read(CustomVector& out, size_t maxBytes) {
+        if (finished) {
+            return false;
         }
+#if HW4_HAVE_ZLIB
+        if (compression == Compression::Gzip) {
+            return readGzip(out, maxBytes);
+        }
+#endif
+        size_t produced = 0;
+        while (produced < maxBytes && input.read(inputBlock, min(sizeof(inputBlock), maxBytes - produced)).gcount() > 0) {
+            out.append(inputBlock, input.gcount());
+            produced += input.gcount();
+        }
+        finished = produced < maxBytes;
+        return produced > 0;
+    }
+};
 
-        sort(lineIndices, lineIndices + numLines, [&](int a, int b) {
-            return strcmp(lines[a], lines[b]) < 0;
-        });
+class TextSource {
+public:
+    TextSource() = default;
+    virtual ~TextSource() = default;
 
-        data.clear();
+    virtual void readData() = 0;
+    virtual char* getData() = 0;
 
-        for (int i = 0; i < numLines; i++) {
-            const char *line = lines[lineIndices[i]];
-            while (*line) {
-                data.push_back(*line);
-                line++;
-            }
-            if (i < numLines - 1) {
-                data.push_back('\n');
-            }
-        }
+    // Cheap identity of the data readData() would produce, e.g. from file metadata. Sources
+    // that cannot tell without reading return false.
+    virtual bool fingerprint(uint64_t&) const {
+        return false;
     }
 };
 
-class RemoveDuplicateLines : public TextTransform {
+class TextFileSource : public TextSource {
+    const char* fileName;
+    CustomVector buffer;
+    unique_ptr<DecompressingReader> stream;
+    mutable int compressed;
 public:
-    explicit RemoveDuplicateLines() = default;
-
-    void apply(CustomVector& data) override {
-        char lines[maxLines][maxLineLen];
-        int numLines = 0;
+    TextFileSource() = delete;
+    explicit TextFileSource(const char* fileName) : TextSource(), fileName(fileName), compressed(-1) {};
 
-        char* token = strtok(data.getData(), "\n");
-        while (token != nullptr && numLines < maxLines) {
-            bool isDuplicate = false;
-            for (int i = 0; i < numLines; i++) {
-                if (strcmp(token, lines[i]) == 0) {
-                    isDuplicate = true;
-                    break;
+    // Compressed files are read decompressed; the format is detected from the first bytes.
+    void readData() override {
+        buffer.clear();
+        if (isCompressed()) {
+            DecompressingReader reader;
+            if (reader.open(fileName)) {
+                while (reader.read(buffer, SIZE_MAX)) {
                 }
             }
-            if (!isDuplicate) {
-                strcpy(lines[numLines], token);
-                numLines++;
+            if (buffer.getSize() > 0) {
+                buffer.push_back('\0');
             }
-            token = strtok(nullptr, "\n");
+            return;
         }
-        data.clear();
 
-        for (int i = 0; i < numLines; i++) {
-            const char* line = lines[i];
-            while (*line) {
-                data.push_back(*line);
-                line++;
-            }
-            if (i < numLines - 1) {
-                data.push_back('\n');
-            }
+        ifstream inputFile(fileName);
+        if (!inputFile) {
+            cerr << "Failed to open the file." << endl;
+            return;
         }
-    }
-};
-
-class CountLines : public TextTransform {
-public:
-    explicit CountLines() = default;
 
-    void apply(CustomVector& data) override {
-        int numLines = 0;
-        char* read = data.getData();
-        while (*read) {
-            if (*read == '\n') {
-                numLines++;
-            }
-            read++;
+        error_code error;
+        uintmax_t fileSize = filesystem::file_size(fileName, error);
+        if (!error) {
+            buffer.reserve(fileSize + 1);
+        }
+        char block[1 << 16];
+        while (inputFile.read(block, sizeof(block)) || inputFile.gcount() > 0) {
+            buffer.append(block, inputFile.gcount());
         }
-        char numLinesStr[16];
-        snprintf(numLinesStr, 16, "%d", numLines);
-
-        data.clear();
 
-        for (int i = 0; numLinesStr[i] != '\0'; i++) {
-            data.push_back(numLinesStr[i]);
+        if (buffer.getSize() > 0) {
+            buffer.push_back('\0');
         }
     }
-};
 
-class CountSymbols : public TextTransform {
-public:
-    explicit CountSymbols() = default;
+    char* getData() override {
+        return buffer.getData();
+    }
 
-    void apply(CustomVector& data) override {
-        int numSymbols = 0;
-        char* read = data.getData();
-        while (*read) {
-            numSymbols++;
-            read++;
+    // Reads up to maxBytes from offset (by default up to the end of the file) without
+    // text-mode translation.
+    bool readFrom(uint64_t offset, size_t maxBytes = SIZE_MAX) {
+        buffer.clear();
+        ifstream inputFile(fileName, ios::binary);
+        if (!inputFile || !inputFile.seekg(static_cast<streamoff>(offset))) {
+            cerr << "Failed to open the file." << endl;
+            return false;
         }
-        char numSymbolsStr[16];
-        snprintf(numSymbolsStr, 16, "%d", numSymbols);
-
-        data.clear();
-
-        for (int i = 0; numSymbolsStr[i] != '\0'; i++) {
-            data.push_back(numSymbolsStr[i]);
+        char block[1 << 16];
+        while (buffer.getSize() < maxBytes &&
+               (inputFile.read(block, min(sizeof(block), maxBytes - buffer.getSize())) || inputFile.gcount() > 0)) {
+            buffer.append(block, inputFile.gcount());
         }
+        return true;
     }
-};
 
-class TextOutput {
-public:
-    explicit TextOutput() = default;
+    // Reads the next maxBytes of the (decompressed) file, continuing where the previous call
+    // stopped. Returns false at the end of the file, and starts over on the next call.
+    bool readChunk(size_t maxBytes) {
+        buffer.clear();
+        if (!stream) {
+            stream = make_unique<DecompressingReader>();
+            if (!stream->open(fileName)) {
+                stream.reset();
+                return false;
+            }
+        }
+        if (!stream->read(buffer, maxBytes)) {
+            stream.reset();
+            return false;
+        }
+        return true;
+    }
 
-    virtual void writeData(const CustomVector& dataToWrite) = 0;
-};
+    // Makes the next readChunk start from the beginning of the file.
+    void rewind() {
+        stream.reset();
+    }
 
-class TextConsoleOutput : public TextOutput {
-public:
-    explicit TextConsoleOutput() = default;
+    size_t getSize() const {
+        return buffer.getSize();
+    }
 
-    void writeData(const CustomVector& dataToWrite) override {
-        cout << dataToWrite;
+    const char* getFileName() const {
+        return fileName;
     }
-};
 
-class TextFileOutput : public TextOutput {
-    int maxSizeK;
-    const char* fileName;
-    int currFileSize;
-    int fileIndex;
-    ofstream outputFile;
-    CustomVector data;
-public:
-    explicit TextFileOutput(int maxSizeK)
-            : TextOutput(), maxSizeK(maxSizeK), fileName("../output"), currFileSize(0), fileIndex(0) {
-        createNewFile();
+    // Detected from the first bytes on the first call; later calls reuse the answer.
+    bool isCompressed() const {
+        if (compressed < 0) {
+            ifstream inputFile(fileName, ios::binary);
+            char magic[4];
+            inputFile.read(magic, sizeof(magic));
+            compressed = detectCompression(magic, inputFile.gcount()) != Compression::None;
+        }
+        return compressed > 0;
     }
 
-    TextFileOutput(const TextFileOutput& other) = delete;
-    TextFileOutput& operator=(const TextFileOutput& other) = delete;
+    // Compressed text is assumed to expand this much when sizing memory.
+    static constexpr size_t compressionRatio = 4;
 
-    void createNewFile() {
-        if (outputFile.is_open()) {
-            outputFile.close();
-            fileIndex++;
+    // Bytes the file is expected to hold once read, estimated for compressed files.
+    size_t estimateSize() const {
+        error_code error;
+        uintmax_t fileSize = filesystem::file_size(fileName, error);
+        if (error) {
+            return 0;
         }
-        char newFileName[100];
-        snprintf(newFileName, sizeof(newFileName), "%s_%03d.txt", fileName, fileIndex);
-        outputFile.open(newFileName);
+        return static_cast<size_t>(fileSize) * (isCompressed() ? compressionRatio : 1);
     }
 
-    void writeData(const CustomVector& dataToWrite) override {
-        for (size_t i = 0; i < dataToWrite.getSize(); ++i) {
-            data.push_back(dataToWrite[i]);
-            if (currFileSize >= maxSizeK) {
-                createNewFile();
-                currFileSize = 0;
-            }
-            outputFile.write(&dataToWrite[i], 1);
-            currFileSize++;
+    bool fingerprint(uint64_t& hash) const override {
+        error_code error;
+        uintmax_t fileSize = filesystem::file_size(fileName, error);
+        if (error) {
+            return false;
         }
+        auto modified = filesystem::last_write_time(fileName, error);
+        if (error) {
+            return false;
+        }
+        uint64_t metadata[2] = { static_cast<uint64_t>(fileSize),
+                                 static_cast<uint64_t>(modified.time_since_epoch().count()) };
+        hash = hashBytes(fileName, strlen(fileName), hashBytes(reinterpret_cast<const char*>(metadata), sizeof(metadata)));
+        return true;
     }
 };
 
-class TextProcessor {
-    TextSource** sources;
-    int numSources;
-    TextTransform** transformations;
-    int numTransformations;
-    TextOutput** outputs;
-    int numOutputs;
-
-    CustomVector concatData;
+class TextConsoleSource : public TextSource {
+    CustomVector data;
+public:
+    TextConsoleSource() : TextSource() {};
+
+    void readData() override {
+        char inputChar;
+
+        cout << "Enter characters: ";
+
+        data.clear();
+
+        while (cin.get(inputChar) && inputChar != '\n') {
+            data.push_back(inputChar);
+        }
+        data.push_back('\0');
+    }
+
+    char* getData() override {
+        return data.getData();
+    }
+};
+
+// On-disk inverted index written by InvertedIndexOutput. Layout (native byte order):
+//   header      "HW4INDX1", uint64 termCount, uint64 lineCount, uint64 dictionaryOffset
+//   postings    per term: varint count, then varint deltas of ascending line IDs
+//   dictionary  termCount entries sorted by term:
+//               uint64 termOffset, uint64 postingsOffset, uint32 termLen, uint32 postingsLen
+//   terms       the term bytes referenced by termOffset
+class InvertedIndex {
+    static const size_t headerSize = 32;
+    static const size_t entrySize = 24;
+
+    MappedFile file;
+    uint64_t termCount;
+    uint64_t lineCount;
+    const char* dictionary;
+
+    bool inFile(uint64_t offset, uint64_t length) const {
+        return offset <= file.getSize() && length <= file.getSize() - offset;
+    }
+
+    // False if the entry points outside the file.
+    bool termAt(uint64_t entry, string_view& term) const {
+        const char* record = dictionary + entry * entrySize;
+        uint64_t offset = readRaw<uint64_t>(record);
+        uint32_t length = readRaw<uint32_t>(record + 16);
+        if (!inFile(offset, length)) {
+            cerr << "Corrupt index entry." << endl;
+            return false;
+        }
+        term = string_view(file.getData() + offset, length);
+        return true;
+    }
+public:
+    InvertedIndex() : termCount(0), lineCount(0), dictionary(nullptr) {}
+
+    bool open(const char* fileName) {
+        termCount = 0;
+        if (!file.open(fileName)) {
+            return false;
+        }
+        const char* bytes = file.getData();
+        if (file.getSize() < headerSize || memcmp(bytes, "HW4INDX1", 8) != 0) {
+            cerr << "Invalid index file." << endl;
+            return false;
+        }
+        uint64_t dictionaryOffset = readRaw<uint64_t>(bytes + 24);
+        uint64_t count = readRaw<uint64_t>(bytes + 8);
+        if (dictionaryOffset > file.getSize() || count > (file.getSize() - dictionaryOffset) / entrySize) {
+            cerr << "Invalid index file." << endl;
+            return false;
+        }
+        termCount = count;
+        lineCount = readRaw<uint64_t>(bytes + 16);
+        dictionary = bytes + dictionaryOffset;
+        return true;
+    }
+
+    uint64_t getTermCount() const {
+        return termCount;
+    }
+
+    uint64_t getLineCount() const {
+        return lineCount;
+    }
+
+    bool lookup(string_view term, vector<uint32_t>& lines) const {
+        lines.clear();
+        uint64_t low = 0;
+        uint64_t high = termCount;
+        string_view candidate;
+        while (low < high) {
+            uint64_t middle = low + (high - low) / 2;
+            if (!termAt(middle, candidate)) {
+                return false;
+            }
+            if (candidate < term) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        if (low == termCount || !termAt(low, candidate) || candidate != term) {
+            return false;
+        }
+        const char* record = dictionary + low * entrySize;
+        uint64_t postingOffset = readRaw<uint64_t>(record + 8);
+        uint32_t postingLength = readRaw<uint32_t>(record + 20);
+        if (!inFile(postingOffset, postingLength)) {
+            cerr << "Corrupt posting list." << endl;
+            return false;
+        }
+        const char* read = file.getData() + postingOffset;
+        const char* end = read + postingLength;
+        uint64_t count;
+        // Every line ID takes at least one byte.
+        if (!readVarint(read, end, count) || count > static_cast<uint64_t>(end - read)) {
+            cerr << "Corrupt posting list." << endl;
+            return false;
+        }
+        lines.reserve(count);
+        uint64_t line = 0;
+        for (uint64_t i = 0; i < count; ++i) {
+            uint64_t delta;
+            if (!readVarint(read, end, delta)) {
+                cerr << "Corrupt posting list." << endl;
+                return false;
+            }
+            line += delta;
+            if (line >= lineCount) {
+                cerr << "Corrupt posting list." << endl;
+                return false;
+            }
+            lines.push_back(static_cast<uint32_t>(line));
+        }
+        return true;
+    }
+
+    // Line IDs (0-based, ascending) containing all (matchAll) or any of the query words.
+    vector<uint32_t> query(const char* words, bool matchAll) const {
+        vector<vector<uint32_t>> postings;
+        string term;
+        bool missing = false;
+        forEachIndexTerm(words, strlen(words), term, [&](const string& queryTerm) {
+            vector<uint32_t> lines;
+            if (lookup(queryTerm, lines)) {
+                postings.push_back(lines);
+            } else {
+                missing = true;
+            }
+        });
+
+        vector<uint32_t> result;
+        if (postings.empty() || (matchAll && missing)) {
+            return result;
+        }
+        sort(postings.begin(), postings.end(), [](const vector<uint32_t>& a, const vector<uint32_t>& b) {
+            return a.size() < b.size();
+        });
+        result = postings[0];
+        for (size_t i = 1; i < postings.size(); ++i) {
+            vector<uint32_t> combined;
+            if (matchAll) {
+                set_intersection(result.begin(), result.end(), postings[i].begin(), postings[i].end(),
+                                 back_inserter(combined));
+            } else {
+                set_union(result.begin(), result.end(), postings[i].begin(), postings[i].end(),
+                          back_inserter(combined));
+            }
+            result.swap(combined);
+        }
+        return result;
+    }
+};
+
+// Answers an AND/OR word query against an index and yields the matching 1-based line
+// numbers, one per line.
+class IndexQuerySource : public TextSource {
+    const char* indexFileName;
+    const char* words;
+    bool matchAll;
+    CustomVector data;
+public:
+    explicit IndexQuerySource(const char* indexFileName, const char* words, bool matchAll = true)
+            : TextSource(), indexFileName(indexFileName), words(words), matchAll(matchAll) {}
+
+    void readData() override {
+        data.clear();
+        InvertedIndex index;
+        if (index.open(indexFileName)) {
+            for (uint32_t line : index.query(words, matchAll)) {
+                char lineStr[16];
+                int lineLen = snprintf(lineStr, sizeof(lineStr), "%u\n", line + 1);
+                data.append(lineStr, lineLen);
+            }
+        }
+        data.push_back('\0');
+    }
+
+    char* getData() override {
+        return data.getData();
+    }
+};
+
+// Archive of named members: their bytes back to back, then an index, then a fixed-size
+// trailer that locates the index:
+//
+//   members | index | uint64 index offset | uint64 member count | "HW4ARCH1"
+//
+// An index entry is the varint length of the member's name, the name, and the member's
+// uint64 offset, length and checksum (hashBytes of its bytes). A reader seeks to the
+// trailer, to the index and to the member, however large the archive is.
+class ArchiveIndex {
+public:
+    struct Member {
+        string name;
+        uint64_t offset;
+        uint64_t length;
+        uint64_t checksum;
+    };
+
+    static constexpr size_t trailerSize = 24;
+
+    static void write(CustomVector& out, const vector<Member>& members, uint64_t indexOffset) {
+        for (const Member& member : members) {
+            appendVarint(out, member.name.size());
+            out.append(member.name.data(), member.name.size());
+            appendRaw<uint64_t>(out, member.offset);
+            appendRaw<uint64_t>(out, member.length);
+            appendRaw<uint64_t>(out, member.checksum);
+        }
+        appendRaw<uint64_t>(out, indexOffset);
+        appendRaw<uint64_t>(out, members.size());
+        out.append("HW4ARCH1", 8);
+    }
+
+    // Reads the member list; indexOffset is where the members end.
+    static bool read(const char* fileName, vector<Member>& members, uint64_t& indexOffset) {
+        members.clear();
+        ifstream archive(fileName, ios::binary);
+        error_code error;
+        uintmax_t fileSize = filesystem::file_size(fileName, error);
+        char trailer[trailerSize];
+        if (!archive || error || fileSize < trailerSize ||
+            !archive.seekg(static_cast<streamoff>(fileSize - trailerSize)) || !archive.read(trailer, trailerSize) ||
+            memcmp(trailer + 16, "HW4ARCH1", 8) != 0) {
+            cerr << "Invalid archive file." << endl;
+            return false;
+        }
+        indexOffset = readRaw<uint64_t>(trailer);
+        uint64_t count = readRaw<uint64_t>(trailer + 8);
+        if (indexOffset > fileSize - trailerSize) {
+            cerr << "Invalid archive file." << endl;
+            return false;
+        }
+        string index(fileSize - trailerSize - indexOffset, '\0');
+        if (!archive.seekg(static_cast<streamoff>(indexOffset)) || !archive.read(&index[0], index.size())) {
+            cerr << "Invalid archive file." << endl;
+            return false;
+        }
+        const char* read = index.data();
+        const char* end = read + index.size();
+        for (uint64_t i = 0; i < count; ++i) {
+            uint64_t nameLength;
+            if (!readVarint(read, end, nameLength) || nameLength > static_cast<uint64_t>(end - read) ||
+                static_cast<uint64_t>(end - read) - nameLength < 24) {
+                cerr << "Invalid archive file." << endl;
+                return false;
+            }
+            Member member;
+            member.name.assign(read, nameLength);
+            read += nameLength;
+            member.offset = readRaw<uint64_t>(read);
+            member.length = readRaw<uint64_t>(read + 8);
+            member.checksum = readRaw<uint64_t>(read + 16);
+            read += 24;
+            if (member.offset > indexOffset || member.length > indexOffset - member.offset) {
+                cerr << "Invalid archive file." << endl;
+                return false;
+            }
+            members.push_back(move(member));
+        }
+        return true;
+    }
+};
+
+// Reads one member of an archive written by ArchiveOutput, seeking straight to it through
+// the index and checking its checksum. Without a member name, lists the members as
+// "offset<TAB>length<TAB>name" lines.
+class ArchiveMemberSource : public TextSource {
+    const char* archiveName;
+    const char* memberName;
+    CustomVector data;
+public:
+    explicit ArchiveMemberSource(const char* archiveName, const char* memberName = nullptr)
+            : TextSource(), archiveName(archiveName), memberName(memberName) {}
+
+    void readData() override {
+        data.clear();
+        vector<ArchiveIndex::Member> members;
+        uint64_t indexOffset;
+        if (!ArchiveIndex::read(archiveName, members, indexOffset)) {
+            return;
+        }
+        if (!memberName) {
+            for (const ArchiveIndex::Member& member : members) {
+                string line = to_string(member.offset) + '\t' + to_string(member.length) + '\t' + member.name + '\n';
+                data.append(line.data(), line.size());
+            }
+            data.push_back('\0');
+            return;
+        }
+        auto member = find_if(members.begin(), members.end(), [&](const ArchiveIndex::Member& candidate) {
+            return candidate.name == memberName;
+        });
+        if (member == members.end()) {
+            cerr << "Archive " << archiveName << " has no member " << memberName << "." << endl;
+            return;
+        }
+        ifstream archive(archiveName, ios::binary);
+        data.reserve(member->length + 1);
+        char block[1 << 16];
+        uint64_t remaining = member->length;
+        archive.seekg(static_cast<streamoff>(member->offset));
+        while (remaining > 0 && archive.read(block, min<uint64_t>(sizeof(block), remaining))) {
+            data.append(block, archive.gcount());
+            remaining -= archive.gcount();
+        }
+        if (remaining > 0 || hashBytes(data.getData(), data.getSize()) != member->checksum) {
+            cerr << "Archive member " << memberName << " is damaged." << endl;
+            data.clear();
+            return;
+        }
+        if (data.getSize() > 0) {
+            data.push_back('\0');
+        }
+    }
+
+    char* getData() override {
+        return data.getData();
+    }
+};
+
+class HyperLogLog {
+    int precision;
+    size_t numRegisters;
+    uint8_t* registers;
+
+    void copyFrom(const HyperLogLog& other) {
+        precision = other.precision;
+        numRegisters = other.numRegisters;
+        registers = new uint8_t[numRegisters];
+        copy(other.registers, other.registers + numRegisters, registers);
+    }
+public:
+    static constexpr int minPrecision = 4;
+    static constexpr int maxPrecision = 18;
+
+    explicit HyperLogLog(int precision = 14)
+            : precision(min(max(precision, minPrecision), maxPrecision)),
+              numRegisters(size_t(1) << this->precision),
+              registers(new uint8_t[numRegisters]()) {}
+
+    HyperLogLog(const HyperLogLog& other) : registers(nullptr) {
+        copyFrom(other);
+    }
+
+    HyperLogLog& operator=(const HyperLogLog& other) {
+        if (this != &other) {
+            delete[] registers;
+            copyFrom(other);
+        }
+        return *this;
+    }
+
+    ~HyperLogLog() {
+        delete[] registers;
+    }
+
+    void add(uint64_t hash) {
+        size_t index = hash >> (64 - precision);
+        uint64_t remaining = (hash << precision) | (1ULL << (precision - 1));
+        uint8_t rank = static_cast<uint8_t>(countLeadingZeros(remaining) + 1);
+        if (rank > registers[index]) {
+            registers[index] = rank;
+        }
+    }
+
+    void add(const char* bytes, size_t length) {
+        add(hashBytes(bytes, length));
+    }
+
+    bool merge(const HyperLogLog& other) {
+        if (other.precision != precision) {
+            cerr << "Cannot merge sketches with different precision." << endl;
+            return false;
+        }
+        for (size_t i = 0; i < numRegisters; ++i) {
+            registers[i] = max(registers[i], other.registers[i]);
+        }
+        return true;
+    }
+
+    double estimate() const {
+        double m = static_cast<double>(numRegisters);
+        double alpha;
+        switch (numRegisters) {
+            case 16: alpha = 0.673; break;
+            case 32: alpha = 0.697; break;
+            case 64: alpha = 0.709; break;
+            default: alpha = 0.7213 / (1.0 + 1.079 / m); break;
+        }
+        double sum = 0.0;
+        size_t zeroRegisters = 0;
+        for (size_t i = 0; i < numRegisters; ++i) {
+            sum += ldexp(1.0, -registers[i]);
+            if (registers[i] == 0) {
+                zeroRegisters++;
+            }
+        }
+        double raw = alpha * m * m / sum;
+        if (raw <= 2.5 * m && zeroRegisters > 0) {
+            return m * log(m / static_cast<double>(zeroRegisters));
+        }
+        return raw;
+    }
+
+    void clear() {
+        fill(registers, registers + numRegisters, 0);
+    }
+
+    int getPrecision() const {
+        return precision;
+    }
+
+    size_t getMemoryBytes() const {
+        return numRegisters;
+    }
+
+    // Layout: "HLL" tag, precision byte, then one byte per register.
+    void serialize(CustomVector& out) const {
+        out.push_back('H');
+        out.push_back('L');
+        out.push_back('L');
+        out.push_back(static_cast<char>(precision));
+        for (size_t i = 0; i < numRegisters; ++i) {
+            out.push_back(static_cast<char>(registers[i]));
+        }
+    }
+
+    bool deserialize(const char* bytes, size_t length) {
+        if (length < 4 || memcmp(bytes, "HLL", 3) != 0) {
+            cerr << "Invalid sketch data." << endl;
+            return false;
+        }
+        int storedPrecision = bytes[3];
+        if (storedPrecision < minPrecision || storedPrecision > maxPrecision ||
+            length != 4 + (size_t(1) << storedPrecision)) {
+            cerr << "Invalid sketch data." << endl;
+            return false;
+        }
+        if (storedPrecision != precision) {
+            *this = HyperLogLog(storedPrecision);
+        }
+        copy(bytes + 4, bytes + length, registers);
+        return true;
+    }
+};
+
+static const char* findLiteral(const char* haystack, size_t haystackLen, const char* needle, size_t needleLen) {
+    if (needleLen == 0) {
+        return haystack;
+    }
+    const char* end = haystack + haystackLen;
+    const char* read = haystack;
+
+    while (static_cast<size_t>(end - read) >= needleLen) {
+        const void* first = memchr(read, needle[0], (end - read) - needleLen + 1);
+        if (!first) {
+            return nullptr;
+        }
+        read = static_cast<const char*>(first);
+        if (memcmp(read + 1, needle + 1, needleLen - 1) == 0) {
+            return read;
+        }
+        read++;
+    }
+    return nullptr;
+}
+
+class LineIndex {
+    vector<size_t> lineStarts;
+    size_t textLen = 0;
+public:
+    void build(const char* text, size_t length) {
+        lineStarts.clear();
+        textLen = (length > 0 && text[length - 1] == '\n') ? length - 1 : length;
+        if (length == 0) {
+            return;
+        }
+        lineStarts.push_back(0);
+        const char* read = text;
+        const char* end = text + length;
+        while (const void* newline = memchr(read, '\n', end - read)) {
+            read = static_cast<const char*>(newline) + 1;
+            if (read < end) {
+                lineStarts.push_back(read - text);
+            }
+        }
+    }
+
+    size_t getLineCount() const {
+        return lineStarts.size();
+    }
+
+    size_t lineStart(size_t line) const {
+        return lineStarts[line];
+    }
+
+    // End of the line's content, excluding its newline.
+    size_t lineEnd(size_t line) const {
+        return (line + 1 < lineStarts.size()) ? lineStarts[line + 1] - 1 : textLen;
+    }
+
+    size_t lineOf(size_t offset) const {
+        return (upper_bound(lineStarts.begin(), lineStarts.end(), offset) - lineStarts.begin()) - 1;
+    }
+};
+
+// Grep-style regular expression (literals, ., [...], [^...], \d \w \s and their negations,
+// *, +, ?, |, grouping, ^ and $ at the start and end of each alternative) compiled to a
+// Thompson NFA and matched through a lazily built DFA, so every line is scanned once without
+// backtracking. Anchors are assertion states: ^ passes only before the first character and
+// $ only after the last.
+class Regex {
+    enum StateType { CharSet, Split, Match, LineStart, LineEnd };
+
+    struct NfaState {
+        StateType type;
+        bitset<256> chars;
+        int out;
+        int out1;
+    };
+
+    struct Fragment {
+        int start;
+        vector<pair<int, int>> danglingOuts;
+    };
+
+    struct DfaState {
+        vector<int> nfaStates;
+        bool accepting;         // matched already, whatever follows
+        bool acceptingAtEnd;    // matched if the line ends here
+        int next[256];
+    };
+
+    static const int maxDfaStates = 1024;
+
+    vector<NfaState> nfa;
+    int startState;
+    bool anchoredStart;     // every alternative starts with ^, so no match starts later
+    bool valid;
+    string literalPrefix;
+
+    const char* pattern;
+    size_t patternLen;
+    size_t pos;
+
+    vector<DfaState> dfa;
+    map<vector<int>, int> dfaIndex;
+    int startDfa;
+    vector<int> closureStack;
+    vector<char> closureMark;
+
+    int addState(StateType type, int out = -1, int out1 = -1) {
+        nfa.push_back({type, bitset<256>(), out, out1});
+        return static_cast<int>(nfa.size()) - 1;
+    }
+
+    void patch(const vector<pair<int, int>>& outs, int target) {
+        for (const auto& danglingOut : outs) {
+            if (danglingOut.second == 0) {
+                nfa[danglingOut.first].out = target;
+            } else {
+                nfa[danglingOut.first].out1 = target;
+            }
+        }
+    }
+
+    Fragment charSetFragment(const bitset<256>& chars) {
+        int state = addState(CharSet);
+        nfa[state].chars = chars;
+        return {state, {{state, 0}}};
+    }
+
+    Fragment emptyFragment() {
+        int state = addState(Split);
+        return {state, {{state, 0}}};
+    }
+
+    Fragment assertionFragment(StateType type) {
+        int state = addState(type);
+        return {state, {{state, 0}}};
+    }
+
+    static bitset<256> escapeClass(char c, bool& isClass) {
+        bitset<256> chars;
+        isClass = true;
+        for (int b = 0; b < 256; ++b) {
+            bool member;
+            switch (tolower(c)) {
+                case 'd': member = isdigit(b); break;
+                case 'w': member = isalnum(b) || b == '_'; break;
+                case 's': member = isspace(b); break;
+                default: isClass = false; return chars;
+            }
+            chars[b] = (isupper(c) != 0) != member;
+        }
+        return chars;
+    }
+
+    bool parseBracket(bitset<256>& chars) {
+        bool negate = false;
+        if (pos < patternLen && pattern[pos] == '^') {
+            negate = true;
+            pos++;
+        }
+        bool first = true;
+        while (pos < patternLen && (pattern[pos] != ']' || first)) {
+            first = false;
+            unsigned char low = pattern[pos++];
+            if (low == '\\' && pos < patternLen) {
+                bool isClass;
+                bitset<256> escaped = escapeClass(pattern[pos], isClass);
+                if (isClass) {
+                    chars |= escaped;
+                    pos++;
+                    continue;
+                }
+                low = pattern[pos++];
+            }
+            unsigned char high = low;
+            if (pos + 1 < patternLen && pattern[pos] == '-' && pattern[pos + 1] != ']') {
+                high = pattern[pos + 1];
+                pos += 2;
+            }
+            for (int b = low; b <= high; ++b) {
+                chars[b] = true;
+            }
+        }
+        if (pos >= patternLen) {
+            return false;
+        }
+        pos++;
+        if (negate) {
+            chars.flip();
+            chars['\n'] = false;
+        }
+        return true;
+    }
+
+    bool parseAtom(Fragment& fragment) {
+        char c = pattern[pos++];
+        bitset<256> chars;
+        switch (c) {
+            case '(':
+                if (!parseAlternation(fragment) || pos >= patternLen || pattern[pos] != ')') {
+                    return false;
+                }
+                pos++;
+                return true;
+            case '[':
+                if (!parseBracket(chars)) {
+                    return false;
+                }
+                break;
+            case '.':
+                chars.set();
+                chars['\n'] = false;
+                break;
+            case '\\': {
+                if (pos >= patternLen) {
+                    return false;
+                }
+                bool isClass;
+                chars = escapeClass(pattern[pos], isClass);
+                if (!isClass) {
+                    chars[static_cast<unsigned char>(pattern[pos])] = true;
+                }
+                pos++;
+                break;
+            }
+            case '*':
+            case '+':
+            case '?':
+            case ')':
+            case '|':
+                return false;
+            default:
+                chars[static_cast<unsigned char>(c)] = true;
+                break;
+        }
+        fragment = charSetFragment(chars);
+        return true;
+    }
+
+    bool parseRepeat(Fragment& fragment) {
+        if (!parseAtom(fragment)) {
+            return false;
+        }
+        while (pos < patternLen && (pattern[pos] == '*' || pattern[pos] == '+' || pattern[pos] == '?')) {
+            char op = pattern[pos++];
+            int split = addState(Split, fragment.start, -1);
+            if (op == '*') {
+                patch(fragment.danglingOuts, split);
+                fragment = {split, {{split, 1}}};
+            } else if (op == '+') {
+                patch(fragment.danglingOuts, split);
+                fragment.danglingOuts = {{split, 1}};
+            } else {
+                fragment.danglingOuts.push_back({split, 1});
+                fragment.start = split;
+            }
+        }
+        return true;
+    }
+
+    // ^ at the start and $ at the end of an alternative are anchors; elsewhere they are
+    // literal characters.
+    bool parseConcat(Fragment& fragment) {
+        bool empty = true;
+        if (pos < patternLen && pattern[pos] == '^') {
+            pos++;
+            fragment = assertionFragment(LineStart);
+            empty = false;
+        }
+        while (pos < patternLen && pattern[pos] != '|' && pattern[pos] != ')') {
+            Fragment next;
+            if (pattern[pos] == '$' && (pos + 1 == patternLen || pattern[pos + 1] == '|' || pattern[pos + 1] == ')')) {
+                pos++;
+                next = assertionFragment(LineEnd);
+            } else if (!parseRepeat(next)) {
+                return false;
+            }
+            if (empty) {
+                fragment = next;
+                empty = false;
+            } else {
+                patch(fragment.danglingOuts, next.start);
+                fragment.danglingOuts = next.danglingOuts;
+            }
+        }
+        if (empty) {
+            fragment = emptyFragment();
+        }
+        return true;
+    }
+
+    bool parseAlternation(Fragment& fragment) {
+        if (!parseConcat(fragment)) {
+            return false;
+        }
+        while (pos < patternLen && pattern[pos] == '|') {
+            pos++;
+            Fragment right;
+            if (!parseConcat(right)) {
+                return false;
+            }
+            int split = addState(Split, fragment.start, right.start);
+            fragment.start = split;
+            fragment.danglingOuts.insert(fragment.danglingOuts.end(),
+                                         right.danglingOuts.begin(), right.danglingOuts.end());
+        }
+        return true;
+    }
+
+    void extractLiteralPrefix() {
+        size_t read = (patternLen > 0 && pattern[0] == '^') ? 1 : 0;
+        for (size_t i = read; i < patternLen; ++i) {
+            if (pattern[i] == '|' || (pattern[i] == '\\' && i + 1 < patternLen && pattern[i + 1] == '|')) {
+                return;
+            }
+        }
+        while (read < patternLen) {
+            char c = pattern[read];
+            size_t next = read + 1;
+            if (c == '\\') {
+                if (next >= patternLen || isalnum(static_cast<unsigned char>(pattern[next]))) {
+                    break;
+                }
+                c = pattern[next++];
+            } else if (strchr(".[()*+?|$", c)) {
+                break;
+            }
+            if (next < patternLen && (pattern[next] == '*' || pattern[next] == '?')) {
+                break;
+            }
+            literalPrefix.push_back(c);
+            if (next < patternLen && pattern[next] == '+') {
+                break;
+            }
+            read = next;
+        }
+    }
+
+    // atLineStart lets the closure pass ^ assertions.
+    void addClosure(int state, vector<int>& states, bool atLineStart = false) {
+        closureStack.push_back(state);
+        while (!closureStack.empty()) {
+            int current = closureStack.back();
+            closureStack.pop_back();
+            if (current < 0 || closureMark[current]) {
+                continue;
+            }
+            closureMark[current] = 1;
+            states.push_back(current);
+            if (nfa[current].type == Split) {
+                closureStack.push_back(nfa[current].out1);
+                closureStack.push_back(nfa[current].out);
+            } else if (nfa[current].type == LineStart && atLineStart) {
+                closureStack.push_back(nfa[current].out);
+            }
+        }
+    }
+
+    // True if the match state is reachable from state through $ assertions and splits, i.e.
+    // once the line has ended.
+    bool matchesAtEnd(int state) const {
+        vector<int> stack = { state };
+        vector<char> seen(nfa.size(), 0);
+        while (!stack.empty()) {
+            int current = stack.back();
+            stack.pop_back();
+            if (current < 0 || seen[current]) {
+                continue;
+            }
+            seen[current] = 1;
+            switch (nfa[current].type) {
+                case Match: return true;
+                case Split: stack.push_back(nfa[current].out1); stack.push_back(nfa[current].out); break;
+                case LineEnd: stack.push_back(nfa[current].out); break;
+                default: break;
+            }
+        }
+        return false;
+    }
+
+    int internState(vector<int>& states) {
+        for (int state : states) {
+            closureMark[state] = 0;
+        }
+        sort(states.begin(), states.end());
+        auto found = dfaIndex.find(states);
+        if (found != dfaIndex.end()) {
+            return found->second;
+        }
+        DfaState dfaState;
+        dfaState.nfaStates = states;
+        dfaState.accepting = false;
+        dfaState.acceptingAtEnd = false;
+        for (int state : states) {
+            if (nfa[state].type == Match) {
+                dfaState.accepting = true;
+            } else if (nfa[state].type == LineEnd && matchesAtEnd(state)) {
+                dfaState.acceptingAtEnd = true;
+            }
+        }
+        dfaState.acceptingAtEnd = dfaState.acceptingAtEnd || dfaState.accepting;
+        fill(dfaState.next, dfaState.next + 256, -1);
+        dfa.push_back(dfaState);
+        int index = static_cast<int>(dfa.size()) - 1;
+        dfaIndex[states] = index;
+        return index;
+    }
+
+    int startDfaState() {
+        if (startDfa < 0) {
+            vector<int> states;
+            addClosure(startState, states, true);
+            startDfa = internState(states);
+        }
+        return startDfa;
+    }
+
+    int step(int dfaState, unsigned char c) {
+        int cached = dfa[dfaState].next[c];
+        if (cached >= 0) {
+            return cached;
+        }
+        if (dfa.size() >= maxDfaStates) {
+            vector<int> current = dfa[dfaState].nfaStates;
+            dfa.clear();
+            dfaIndex.clear();
+            startDfa = -1;
+            dfaState = internState(current);
+        }
+        vector<int> states;
+        for (int state : dfa[dfaState].nfaStates) {
+            if (nfa[state].type == CharSet && nfa[state].chars[c]) {
+                addClosure(nfa[state].out, states);
+            }
+        }
+        if (!anchoredStart) {
+            addClosure(startState, states);
+        }
+        int next = internState(states);
+        dfa[dfaState].next[c] = next;
+        return next;
+    }
+public:
+    explicit Regex(const char* expression)
+            : startState(-1), anchoredStart(false), valid(false),
+              pattern(expression), patternLen(expression ? strlen(expression) : 0), pos(0), startDfa(-1) {
+        if (!expression) {
+            return;
+        }
+        Fragment fragment;
+        if (!parseAlternation(fragment) || pos != patternLen) {
+            cerr << "Invalid regular expression: " << expression << endl;
+            return;
+        }
+        int match = addState(Match);
+        patch(fragment.danglingOuts, match);
+        startState = fragment.start;
+        closureMark.assign(nfa.size(), 0);
+        // Without passing ^, a match can only start at the first character if nothing but
+        // anchors is reachable.
+        vector<int> unanchored;
+        addClosure(startState, unanchored);
+        anchoredStart = true;
+        for (int state : unanchored) {
+            closureMark[state] = 0;
+            anchoredStart = anchoredStart && nfa[state].type != CharSet && nfa[state].type != Match &&
+                            nfa[state].type != LineEnd;
+        }
+        extractLiteralPrefix();
+        valid = true;
+    }
+
+    bool isValid() const {
+        return valid;
+    }
+
+    const string& getLiteralPrefix() const {
+        return literalPrefix;
+    }
+
+    size_t getDfaStateCount() const {
+        return dfa.size();
+    }
+
+    bool matches(const char* line, size_t length) {
+        if (!valid) {
+            return false;
+        }
+        const char* read = line;
+        const char* end = line + length;
+        if (!anchoredStart && !literalPrefix.empty()) {
+            read = findLiteral(line, length, literalPrefix.data(), literalPrefix.size());
+            if (!read) {
+                return false;
+            }
+        }
+        int state = startDfaState();
+        for (; read < end; ++read) {
+            if (dfa[state].accepting) {
+                return true;
+            }
+            state = step(state, static_cast<unsigned char>(*read));
+            if (dfa[state].nfaStates.empty()) {
+                return false;
+            }
+        }
+        return dfa[state].acceptingAtEnd;
+    }
+};
+
+// How a transform treats the lines of its input, for the pipeline optimizer.
+enum class LineOperation {
+    None,
+    Filter,     // keeps or drops each line on its own, in input order
+    Sort,       // sorts the non-empty lines
+    Dedup,      // keeps the first occurrence of each non-empty line
+    SortUnique  // sorts the distinct non-empty lines
+};
+
+// What a counting transform counts.
+enum class CountedQuantity {
+    None,
+    Bytes,
+    Lines
+};
+
+// Algebraic properties a transform declares for the pipeline optimizer. The defaults
+// claim nothing, so a transform that declares nothing is never moved or removed.
+struct TransformTraits {
+    LineOperation lineOperation = LineOperation::None;
+    CountedQuantity counts = CountedQuantity::None;
+    bool ignoresFinalNewline = false;   // same output whether or not the input ends in '\n'
+    bool endsWithNewline = false;       // non-empty output always ends in '\n'
+    bool preservesLength = false;       // never changes the length before the first '\0'
+    bool preservesLineCount = false;    // never changes the number of '\n' before the first '\0'
+    double costPerByte = 1.0;           // relative cost estimate
+    double outputRatio = 1.0;           // estimated output bytes per input byte
+};
+
+class TextTransform {
+protected:
+    static const int maxLines = 1000;
+    static const int maxLineLen = 1000;
+
+    static void describeAs(string& description, const char* name, initializer_list<string_view> args = {}) {
+        description += name;
+        description += '(';
+        for (string_view arg : args) {
+            description += to_string(arg.size());
+            description += ':';
+            description += arg;
+            description += ',';
+        }
+        description += ')';
+    }
+public:
+    explicit TextTransform() = default;
+    virtual ~TextTransform() = default;
+
+    virtual void apply(CustomVector& data) = 0;
+
+    // Appends a canonical description of the transform and its arguments, so that equal
+    // descriptions imply equal output for equal input. Returns false if the transform
+    // cannot be described, which disables result caching from that stage on.
+    virtual bool describe(string&) const {
+        return false;
+    }
+
+    // True if applying the transform to two pieces of text, the first ending in a newline,
+    // and concatenating the results equals applying it to the whole text.
+    virtual bool isSplitSafe() const {
+        return false;
+    }
+
+    // True if the transform is split-safe and apply() may run on several pieces at once.
+    virtual bool isParallelSafe() const {
+        return isSplitSafe();
+    }
+
+    virtual TransformTraits traits() const {
+        return TransformTraits();
+    }
+
+    // True if the transform works by inserting and erasing in place and implements edit().
+    // A pipeline applies consecutive such transforms to one TextBuffer and materializes it
+    // once at the end of the run.
+    virtual bool editsText() const {
+        return false;
+    }
+
+    virtual void edit(TextBuffer&) {}
+
+    // For transforms that are not split-safe: combines the output of an earlier run (the
+    // first argument) with the output for newly appended input (the second), leaving the
+    // output for the whole input in the second. Returns false if the transform cannot do this.
+    virtual bool mergeIncremental(const CustomVector&, CustomVector&) const {
+        return false;
+    }
+
+    // True if apply() keeps at most maxLines lines, so that its result for pieces of the
+    // input differs from its result for the whole input.
+    virtual bool hasLineLimit() const {
+        return false;
+    }
+
+    // True if the output of apply() is lines in sortKey() order, without a final newline,
+    // so that outputs for pieces of the input can be merged line by line with sortKey() and
+    // combineLines() instead of mergeIncremental().
+    virtual bool mergesSortedRuns() const {
+        return false;
+    }
+
+    // The part of an output line that output lines are sorted by.
+    virtual string_view sortKey(string_view line) const {
+        return line;
+    }
+
+    // Folds line into kept, an output line with the same sort key; returns false if both
+    // lines stay in the output.
+    virtual bool combineLines(string&, string_view) const {
+        return false;
+    }
+};
+
+// Reentrant equivalent of strtok(text, "\n"): pass the buffer first, then nullptr. Unlike
+// strtok it keeps no global state, so transforms can run on several threads.
+static char* nextLineToken(char* text, char*& save) {
+    char* read = text ? text : save;
+    while (*read == '\n') {
+        read++;
+    }
+    if (*read == '\0') {
+        save = read;
+        return nullptr;
+    }
+    char* token = read;
+    while (*read && *read != '\n') {
+        read++;
+    }
+    if (*read) {
+        *read++ = '\0';
+    }
+    save = read;
+    return token;
+}
+
+static void splitLines(const char* text, size_t length, vector<string_view>& lines) {
+    size_t lineStart = 0;
+    while (lineStart < length) {
+        const void* newline = memchr(text + lineStart, '\n', length - lineStart);
+        size_t lineEnd = newline ? static_cast<const char*>(newline) - text : length;
+        if (lineEnd > lineStart) {
+            lines.emplace_back(text + lineStart, lineEnd - lineStart);
+        }
+        lineStart = lineEnd + 1;
+    }
+}
+
+static void joinLines(const vector<string_view>& lines, CustomVector& data) {
+    data.clear();
+    for (size_t i = 0; i < lines.size(); ++i) {
+        data.append(lines[i].data(), lines[i].size());
+        if (i + 1 < lines.size()) {
+            data.push_back('\n');
+        }
+    }
+}
+
+static bool mergeCounts(const CustomVector& previous, CustomVector& delta) {
+    char* end;
+    unsigned long long previousCount = strtoull(previous.getData() ? previous.getData() : "", &end, 10);
+    if (end == previous.getData()) {
+        return false;
+    }
+    unsigned long long deltaCount = strtoull(delta.getData() ? delta.getData() : "", &end, 10);
+    if (end == delta.getData()) {
+        return false;
+    }
+    char countStr[24];
+    int countLen = snprintf(countStr, sizeof(countStr), "%llu", previousCount + deltaCount);
+    delta.clear();
+    delta.append(countStr, countLen);
+    return true;
+}
+
+class RemoveString : public TextTransform {
+    const char* strToRemove;
+public:
+    explicit RemoveString(const char* strToRemove) : strToRemove(strToRemove) {}
+
+    bool describe(string& description) const override {
+        describeAs(description, "RemoveString", { strToRemove });
+        return true;
+    }
+
+    bool isSplitSafe() const override {
+        return strchr(strToRemove, '\n') == nullptr;
+    }
+
+    TransformTraits traits() const override {
+        TransformTraits traits;
+        traits.preservesLength = *strToRemove == '\0';
+        traits.preservesLineCount = isSplitSafe();
+        return traits;
+    }
+
+    void apply(CustomVector& data) override {
+        size_t removeLen = strlen(strToRemove);
+        const char* read = data.getData();
+        const char* end = read + textLength(data);
+        if (removeLen == 0) {
+            return;
+        }
+        CustomVector result;
+
+        while (read < end) {
+            const char* match = findLiteral(read, end - read, strToRemove, removeLen);
+
+            if (match) {
+                result.append(read, match - read);
+                read = match + removeLen;
+            } else {
+                result.append(read, end - read);
+                break;
+            }
+        }
+        data = result;
+    }
+};
+
+class RemoveLines : public TextTransform {
+    const char* substring;
+public:
+    explicit RemoveLines(const char* substring) : substring(substring) {}
+
+    static void appendString(CustomVector& dest, const char* str) {
+        for (size_t i = 0; str[i] != '\0'; ++i) {
+            dest.push_back(str[i]);
+        }
+    }
+
+    bool describe(string& description) const override {
+        describeAs(description, "RemoveLines", { substring });
+        return true;
+    }
+
+    TransformTraits traits() const override {
+        TransformTraits traits;
+        traits.lineOperation = LineOperation::Filter;
+        traits.ignoresFinalNewline = true;
+        traits.endsWithNewline = true;
+        traits.outputRatio = 0.5;
+        return traits;
+    }
+
+    bool hasLineLimit() const override {
+        return true;
+    }
+
+    void apply(CustomVector& data) override {
+        int numLines = 0;
+        CustomVector result;
+
+        char* save;
+        char* token = nextLineToken(data.getData(), save);
+
+        while (token != nullptr && numLines < maxLines) {
+            if (strstr(token, substring) == nullptr) {
+                appendString(result, token);
+                result.push_back('\n');
+                numLines++;
+            }
+            token = nextLineToken(nullptr, save);
+        }
+        data.clear();
+        data = result;
+    }
+};
+
+enum class FilterMode {
+    Keep,
+    Drop
+};
+
+class FilterLines : public TextTransform {
+    const char* pattern;
+    Regex regex;
+    FilterMode mode;
+public:
+    explicit FilterLines(const char* pattern, FilterMode mode = FilterMode::Drop)
+            : pattern(pattern), regex(pattern), mode(mode) {}
+
+    bool describe(string& description) const override {
+        describeAs(description, "FilterLines", { pattern, mode == FilterMode::Keep ? "keep" : "drop" });
+        return true;
+    }
+
+    bool isSplitSafe() const override {
+        return true;
+    }
+
+    // The lazily built DFA is cached in the instance.
+    bool isParallelSafe() const override {
+        return false;
+    }
+
+    TransformTraits traits() const override {
+        TransformTraits traits;
+        traits.lineOperation = regex.isValid() ? LineOperation::Filter : LineOperation::None;
+        traits.ignoresFinalNewline = regex.isValid();
+        traits.endsWithNewline = regex.isValid();
+        traits.costPerByte = 2.0;
+        traits.outputRatio = 0.5;
+        return traits;
+    }
+
+    void apply(CustomVector& data) override {
+        if (!regex.isValid()) {
+            return;
+        }
+        const char* text = data.getData();
+        size_t length = textLength(data);
+        CustomVector result;
+
+        size_t lineStart = 0;
+        while (lineStart < length) {
+            const void* newline = memchr(text + lineStart, '\n', length - lineStart);
+            size_t lineEnd = newline ? static_cast<const char*>(newline) - text : length;
+
+            if (regex.matches(text + lineStart, lineEnd - lineStart) == (mode == FilterMode::Keep)) {
+                for (size_t i = lineStart; i < lineEnd; ++i) {
+                    result.push_back(text[i]);
+                }
+                result.push_back('\n');
+            }
+            lineStart = lineEnd + 1;
+        }
+        data = result;
+    }
+};
+
+struct SearchOptions {
+    bool lineNumbers = false;
+    bool byteOffsets = false;
+    int contextLines = 0;
+};
+
+class SearchLines : public TextTransform {
+    const char* pattern;
+    SearchOptions options;
+    LineIndex lineIndex;
+
+    void appendLine(CustomVector& result, const char* text, size_t line, size_t start, size_t end, char separator) const {
+        char prefix[48];
+        int prefixLen = 0;
+        if (options.lineNumbers) {
+            prefixLen += snprintf(prefix + prefixLen, sizeof(prefix) - prefixLen, "%zu%c", line + 1, separator);
+        }
+        if (options.byteOffsets) {
+            prefixLen += snprintf(prefix + prefixLen, sizeof(prefix) - prefixLen, "%zu%c", start, separator);
+        }
+        result.append(prefix, prefixLen);
+        result.append(text + start, end - start);
+        result.push_back('\n');
+    }
+public:
+    explicit SearchLines(const char* pattern, SearchOptions options = SearchOptions())
+            : pattern(pattern), options(options) {}
+
+    bool describe(string& description) const override {
+        describeAs(description, "SearchLines", { pattern, options.lineNumbers ? "n" : "", options.byteOffsets ? "b" : "",
+                                                 to_string(options.contextLines) });
+        return true;
+    }
+
+    bool isSplitSafe() const override {
+        return !options.lineNumbers && !options.byteOffsets && options.contextLines <= 0;
+    }
+
+    void apply(CustomVector& data) override {
+        if (!pattern) {
+            return;
+        }
+        const char* text = data.getData();
+        size_t length = textLength(data);
+        size_t patternLen = strlen(pattern);
+        size_t context = options.contextLines > 0 ? options.contextLines : 0;
+        bool indexed = options.lineNumbers || context > 0;
+        CustomVector result;
+
+        if (indexed) {
+            lineIndex.build(text, length);
+        }
+
+        vector<size_t> matchLines;
+        size_t searchFrom = 0;
+        while (searchFrom < length) {
+            const char* match = findLiteral(text + searchFrom, length - searchFrom, pattern, patternLen);
+            if (!match) {
+                break;
+            }
+            size_t offset = match - text;
+            size_t start;
+            size_t end;
+
+            if (indexed) {
+                size_t line = lineIndex.lineOf(offset);
+                matchLines.push_back(line);
+                start = lineIndex.lineStart(line);
+                end = lineIndex.lineEnd(line);
+            } else {
+                start = offset;
+                while (start > searchFrom && text[start - 1] != '\n') {
+                    start--;
+                }
+                const void* newline = memchr(text + offset, '\n', length - offset);
+                end = newline ? static_cast<const char*>(newline) - text : length;
+                appendLine(result, text, 0, start, end, ':');
+            }
+            searchFrom = end + 1;
+        }
+
+        size_t next = 0;
+        for (size_t i = 0; i < matchLines.size(); ++i) {
+            size_t first = matchLines[i] >= context ? matchLines[i] - context : 0;
+            if (first < next) {
+                first = next;
+            } else if (context > 0 && i > 0 && first > next) {
+                result.append("--\n", 3);
+            }
+            size_t last = min(matchLines[i] + context, lineIndex.getLineCount() - 1);
+            for (size_t line = first; line <= last; ++line) {
+                if (i + 1 < matchLines.size() && line == matchLines[i + 1]) {
+                    i++;
+                    last = min(matchLines[i] + context, lineIndex.getLineCount() - 1);
+                }
+                char separator = (line == matchLines[i]) ? ':' : '-';
+                appendLine(result, text, line, lineIndex.lineStart(line), lineIndex.lineEnd(line), separator);
+            }
+            next = last + 1;
+        }
+        data = result;
+    }
+};
+
+class RemoveCharacter : public TextTransform {
+    const char charToRemove;
+public:
+    explicit RemoveCharacter(const char charToRemove) : charToRemove(charToRemove) {}
+
+    bool describe(string& description) const override {
+        describeAs(description, "RemoveCharacter", { string_view(&charToRemove, 1) });
+        return true;
+    }
+
+    bool isSplitSafe() const override {
+        return true;
+    }
+
+    TransformTraits traits() const override {
+        TransformTraits traits;
+        traits.preservesLineCount = charToRemove != '\n' && charToRemove != '\0';
+        return traits;
+    }
+
+    void apply(CustomVector& data) override {
+        size_t read = 0;
+        size_t write = 0;
+
+        while (read < data.getSize()) {
+            if (data[read] != charToRemove) {
+                data[write] = data[read];
+                ++write;
+            }
+            ++read;
+        }
+        data.resize(write);
+    }
+};
+
+class ReplaceString : public TextTransform {
+    const char* oldStr;
+    const char* newStr;
+public:
+    explicit ReplaceString(const char* oldStr, const char* newStr) : oldStr(oldStr), newStr(newStr) {}
+
+    bool describe(string& description) const override {
+        if (!oldStr || !newStr) {
+            return false;
+        }
+        describeAs(description, "ReplaceString", { oldStr, newStr });
+        return true;
+    }
+
+    bool isSplitSafe() const override {
+        return oldStr && newStr && *oldStr && !strchr(oldStr, '\n');
+    }
+
+    TransformTraits traits() const override {
+        TransformTraits traits;
+        bool lineSafe = isSplitSafe() && !strchr(newStr, '\n');
+        traits.preservesLength = lineSafe && strlen(oldStr) == strlen(newStr);
+        traits.preservesLineCount = lineSafe;
+        traits.costPerByte = 2.0;
+        return traits;
+    }
+
+    void apply(CustomVector& data) override {
+        if (!oldStr || !newStr) {
+            return;
+        }
+        size_t oldStrLen = strlen(oldStr);
+        size_t newStrLen = strlen(newStr);
+        size_t dataSize = data.getSize();
+
+        CustomVector result;
+
+        for (size_t i = 0; i < dataSize; ++i) {
+            if (i + oldStrLen <= dataSize) {
+                bool isMatch = true;
+                for (size_t j = 0; j < oldStrLen; ++j) {
+                    if (data[i + j] != oldStr[j]) {
+                        isMatch = false;
+                        break;
+                    }
+                }
+                if (isMatch) {
+                    for (size_t j = 0; j < newStrLen; ++j) {
+                        result.push_back(newStr[j]);
+                    }
+                    i += oldStrLen - 1;
+                } else {
+                    result.push_back(data[i]);
+                }
+            } else {
+                result.push_back(data[i]);
+            }
+        }
+        data.clear();
+
+        for (size_t i = 0; i < result.getSize(); ++i) {
+            data.push_back(result[i]);
+        }
+    }
+};
+
+class RemovePunctuation : public TextTransform {
+public:
+    explicit RemovePunctuation() = default;
+
+    bool describe(string& description) const override {
+        describeAs(description, "RemovePunctuation");
+        return true;
+    }
+
+    bool isSplitSafe() const override {
+        return true;
+    }
+
+    TransformTraits traits() const override {
+        TransformTraits traits;
+        traits.preservesLineCount = true;
+        return traits;
+    }
+
+    void apply(CustomVector& data) override {
+        char* read = data.getData();
+        CustomVector result;
+
+        while (*read) {
+            if (!ispunct(*read)) {
+                result.push_back(*read);
+            }
+            read++;
+        }
+        data.clear();
+
+        for (size_t i = 0; i < result.getSize(); ++i) {
+            data.push_back(result[i]);
+        }
+    }
+};
+
+class AddNewlineSentence : public TextTransform {
+public:
+    explicit AddNewlineSentence() = default;
+
+    bool describe(string& description) const override {
+        describeAs(description, "AddNewlineSentence");
+        return true;
+    }
+
+    bool isSplitSafe() const override {
+        return true;
+    }
+
+    void apply(CustomVector& data) override {
+        size_t length = data.getSize();
+        CustomVector result;
+
+        for (size_t i = 0; i < length; i++) {
+            char currChar = data[i];
+            result.push_back(currChar);
+            if (currChar == '.' || currChar == '!' || currChar == '?') {
+                if (i < length - 1) {
+                    char nextChar = data[i + 1];
+                    if (nextChar != '\n' && nextChar != '.' && nextChar != '\0') {
+                        result.push_back('\n');
+                    }
+                }
+            }
+        }
+        data.clear();
+
+        for (size_t i = 0; i < result.getSize(); i++) {
+            data.push_back(result[i]);
+        }
+    }
+};
+
+class AddNewlineWord : public TextTransform {
+public:
+    explicit AddNewlineWord() = default;
+
+    bool describe(string& description) const override {
+        describeAs(description, "AddNewlineWord");
+        return true;
+    }
+
+    bool isSplitSafe() const override {
+        return true;
+    }
+
+    void apply(CustomVector& data) override {
+        CustomVector result;
+        bool inWord = false;
+
+        for (size_t i = 0; i < data.getSize(); ++i) {
+            char c = data[i];
+            result.push_back(c);
+            if (isspace(c)) {
+                if (inWord) {
+                    result.push_back('\n');
+                    inWord = false;
+                }
+            } else {
+                inWord = true;
+            }
+        }
+        data.clear();
+
+        for (size_t i = 0; i < result.getSize(); ++i) {
+            data.push_back(result[i]);
+        }
+    }
+};
+
+class AddNewlineMaxChars : public TextTransform {
+    int maxCharsK;
+public:
+    explicit AddNewlineMaxChars(int maxCharsK) : maxCharsK(maxCharsK) {}
+
+    bool describe(string& description) const override {
+        describeAs(description, "AddNewlineMaxChars", { to_string(maxCharsK) });
+        return true;
+    }
+
+    bool editsText() const override {
+        return true;
+    }
+
+    void edit(TextBuffer& text) override {
+        size_t currLineLen = 0;
+
+        for (size_t i = 0; i < text.getSize(); i++) {
+            char currentChar = text.at(i);
+            if (currentChar != '\n') {
+                currLineLen++;
+            }
+            if (currLineLen >= static_cast<size_t>(maxCharsK)) {
+                for (size_t j = i; j > 0; j--) {
+                    char breakChar = text.at(j);
+                    if (breakChar == ' ' || breakChar == '\n') {
+                        text.insert(j, "\n", 1);
+                        currLineLen = i - j;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    void apply(CustomVector& data) override {
+        PieceTable text(data);
+        edit(text);
+        text.materialize(data);
+    }
+};
+
+class RemoveNewline : public TextTransform {
+public:
+    explicit RemoveNewline() = default;
+
+    bool describe(string& description) const override {
+        describeAs(description, "RemoveNewline");
+        return true;
+    }
+
+    bool isSplitSafe() const override {
+        return true;
+    }
+
+    void apply(CustomVector& data) override {
+        size_t resIndex = 0;
+
+        for (size_t i = 0; i < data.getSize(); i++) {
+            char currentChar = data[i];
+            if (currentChar != '\n') {
+                data[resIndex++] = currentChar;
+            }
+        }
+        data.resize(resIndex);
+    }
+};
+
+class LexSortLines : public TextTransform {
+public:
+    explicit LexSortLines() = default;
+
+    bool describe(string& description) const override {
+        describeAs(description, "LexSortLines");
+        return true;
+    }
+
+    bool mergeIncremental(const CustomVector& previous, CustomVector& delta) const override {
+        vector<string_view> previousLines;
+        vector<string_view> deltaLines;
+        vector<string_view> merged;
+        splitLines(previous.getData(), textLength(previous), previousLines);
+        splitLines(delta.getData(), textLength(delta), deltaLines);
+        merge(previousLines.begin(), previousLines.end(), deltaLines.begin(), deltaLines.end(),
+              back_inserter(merged));
+        CustomVector result;
+        joinLines(merged, result);
+        delta = result;
+        return true;
+    }
+
+    TransformTraits traits() const override {
+        TransformTraits traits;
+        traits.lineOperation = LineOperation::Sort;
+        traits.ignoresFinalNewline = true;
+        traits.costPerByte = 8.0;
+        return traits;
+    }
+
+    bool hasLineLimit() const override {
+        return true;
+    }
+
+    void apply(CustomVector& data) override {
+        char lines[maxLines][maxLineLen];
+        int lineIndices[maxLines];
+        int numLines = 0;
+
+        char* save;
+        char *token = nextLineToken(data.getData(), save);
+        while (token != nullptr) {
+            strcpy(lines[numLines], token);
+            lineIndices[numLines] = numLines;
+            numLines++;
+            token = nextLineToken(nullptr, save);
+        }
+
+        sort(lineIndices, lineIndices + numLines, [&](int a, int b) {
+            return strcmp(lines[a], lines[b]) < 0;
+        });
+
+        data.clear();
+
+        for (int i = 0; i < numLines; i++) {
+            const char *line = lines[lineIndices[i]];
+            while (*line) {
+                data.push_back(*line);
+                line++;
+            }
+            if (i < numLines - 1) {
+                data.push_back('\n');
+            }
+        }
+    }
+};
+
+class RemoveDuplicateLines : public TextTransform {
+public:
+    explicit RemoveDuplicateLines() = default;
+
+    bool describe(string& description) const override {
+        describeAs(description, "RemoveDuplicateLines");
+        return true;
+    }
+
+    bool mergeIncremental(const CustomVector& previous, CustomVector& delta) const override {
+        vector<string_view> lines;
+        vector<string_view> deltaLines;
+        splitLines(previous.getData(), textLength(previous), lines);
+        splitLines(delta.getData(), textLength(delta), deltaLines);
+        unordered_set<string_view> seen(lines.begin(), lines.end());
+        for (string_view line : deltaLines) {
+            if (seen.insert(line).second) {
+                lines.push_back(line);
+            }
+        }
+        CustomVector result;
+        joinLines(lines, result);
+        delta = result;
+        return true;
+    }
+
+    TransformTraits traits() const override {
+        TransformTraits traits;
+        traits.lineOperation = LineOperation::Dedup;
+        traits.ignoresFinalNewline = true;
+        traits.costPerByte = 16.0;
+        traits.outputRatio = 0.5;
+        return traits;
+    }
+
+    bool hasLineLimit() const override {
+        return true;
+    }
+
+    void apply(CustomVector& data) override {
+        char lines[maxLines][maxLineLen];
+        int numLines = 0;
+
+        char* save;
+        char* token = nextLineToken(data.getData(), save);
+        while (token != nullptr && numLines < maxLines) {
+            bool isDuplicate = false;
+            for (int i = 0; i < numLines; i++) {
+                if (strcmp(token, lines[i]) == 0) {
+                    isDuplicate = true;
+                    break;
+                }
+            }
+            if (!isDuplicate) {
+                strcpy(lines[numLines], token);
+                numLines++;
+            }
+            token = nextLineToken(nullptr, save);
+        }
+        data.clear();
+
+        for (int i = 0; i < numLines; i++) {
+            const char* line = lines[i];
+            while (*line) {
+                data.push_back(*line);
+                line++;
+            }
+            if (i < numLines - 1) {
+                data.push_back('\n');
+            }
+        }
+    }
+};
+
+enum class UniqueMode {
+    Distinct,
+    Count
+};
+
+// Sorts the lines and drops repeated ones in one operator, like sort | uniq, or in Count mode
+// sort | uniq -c ("%7zu line"). Lines are sorted in runs that each drop their equal
+// neighbors, and the runs are merged pairwise dropping equal heads, so repeated lines are
+// never carried into the later merges.
+class SortUnique : public TextTransform {
+    struct Entry {
+        string_view line;
+        size_t count;
+    };
+
+    static constexpr size_t runLines = 1 << 14;
+    UniqueMode mode;
+
+    static void mergeRuns(const vector<Entry>& left, const vector<Entry>& right, vector<Entry>& merged) {
+        merged.clear();
+        merged.reserve(left.size() + right.size());
+        size_t i = 0;
+        size_t j = 0;
+        while (i < left.size() && j < right.size()) {
+            int order = left[i].line.compare(right[j].line);
+            if (order < 0) {
+                merged.push_back(left[i++]);
+            } else if (order > 0) {
+                merged.push_back(right[j++]);
+            } else {
+                merged.push_back({ left[i].line, left[i].count + right[j].count });
+                i++;
+                j++;
+            }
+        }
+        merged.insert(merged.end(), left.begin() + i, left.end());
+        merged.insert(merged.end(), right.begin() + j, right.end());
+    }
+
+    // Reads output of an earlier apply(): sorted lines, with counts in Count mode.
+    void parseOutput(const CustomVector& data, vector<Entry>& entries) const {
+        vector<string_view> lines;
+        splitLines(data.getData(), textLength(data), lines);
+        for (string_view line : lines) {
+            size_t count = 1;
+            if (mode == UniqueMode::Count) {
+                size_t pos = line.find_first_not_of(' ');
+                size_t space = line.find(' ', pos);
+                if (pos == string_view::npos || space == string_view::npos) {
+                    continue;
+                }
+                count = strtoull(string(line.substr(pos, space - pos)).c_str(), nullptr, 10);
+                line.remove_prefix(space + 1);
+            }
+            entries.push_back({ line, count });
+        }
+    }
+
+    void writeOutput(const vector<Entry>& entries, CustomVector& result) const {
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (mode == UniqueMode::Count) {
+                char countStr[24];
+                int countLen = snprintf(countStr, sizeof(countStr), "%7zu ", entries[i].count);
+                result.append(countStr, countLen);
+            }
+            result.append(entries[i].line.data(), entries[i].line.size());
+            if (i + 1 < entries.size()) {
+                result.push_back('\n');
+            }
+        }
+    }
+public:
+    explicit SortUnique(UniqueMode mode = UniqueMode::Distinct) : mode(mode) {}
+
+    bool describe(string& description) const override {
+        describeAs(description, "SortUnique", { mode == UniqueMode::Count ? "count" : "distinct" });
+        return true;
+    }
+
+    TransformTraits traits() const override {
+        TransformTraits traits;
+        traits.lineOperation = (mode == UniqueMode::Distinct) ? LineOperation::SortUnique : LineOperation::None;
+        traits.ignoresFinalNewline = true;
+        traits.costPerByte = 8.0;
+        traits.outputRatio = 0.5;
+        return traits;
+    }
+
+    bool mergeIncremental(const CustomVector& previous, CustomVector& delta) const override {
+        vector<Entry> previousEntries;
+        vector<Entry> deltaEntries;
+        vector<Entry> merged;
+        parseOutput(previous, previousEntries);
+        parseOutput(delta, deltaEntries);
+        mergeRuns(previousEntries, deltaEntries, merged);
+        CustomVector result;
+        writeOutput(merged, result);
+        delta = result;
+        return true;
+    }
+
+    bool mergesSortedRuns() const override {
+        return true;
+    }
+
+    // In Count mode lines are sorted by the text after the count.
+    string_view sortKey(string_view line) const override {
+        if (mode == UniqueMode::Count) {
+            size_t pos = line.find_first_not_of(' ');
+            size_t space = line.find(' ', pos);
+            line.remove_prefix(space == string_view::npos ? line.size() : space + 1);
+        }
+        return line;
+    }
+
+    bool combineLines(string& kept, string_view line) const override {
+        if (mode == UniqueMode::Count) {
+            size_t count = strtoull(kept.c_str(), nullptr, 10) + strtoull(string(line).c_str(), nullptr, 10);
+            char countStr[24];
+            int countLen = snprintf(countStr, sizeof(countStr), "%7zu ", count);
+            kept = string(countStr, countLen) + string(sortKey(kept));
+        }
+        return true;
+    }
+
+    void apply(CustomVector& data) override {
+        vector<string_view> lines;
+        splitLines(data.getData(), textLength(data), lines);
+
+        vector<vector<Entry>> runs;
+        for (size_t start = 0; start < lines.size(); start += runLines) {
+            auto first = lines.begin() + start;
+            auto last = lines.begin() + min(lines.size(), start + runLines);
+            sort(first, last);
+            vector<Entry> run;
+            for (auto line = first; line != last; ++line) {
+                if (!run.empty() && run.back().line == *line) {
+                    run.back().count++;
+                } else {
+                    run.push_back({ *line, 1 });
+                }
+            }
+            runs.push_back(move(run));
+        }
+        while (runs.size() > 1) {
+            vector<vector<Entry>> merged((runs.size() + 1) / 2);
+            for (size_t i = 0; i + 1 < runs.size(); i += 2) {
+                mergeRuns(runs[i], runs[i + 1], merged[i / 2]);
+            }
+            if (runs.size() % 2) {
+                merged.back() = move(runs.back());
+            }
+            runs.swap(merged);
+        }
+
+        // The entries point into data, so the output is built separately.
+        CustomVector result;
+        if (!runs.empty()) {
+            writeOutput(runs[0], result);
+        }
+        data = result;
+    }
+};
+
+class CountLines : public TextTransform {
+public:
+    explicit CountLines() = default;
+
+    bool describe(string& description) const override {
+        describeAs(description, "CountLines");
+        return true;
+    }
+
+    bool mergeIncremental(const CustomVector& previous, CustomVector& delta) const override {
+        return mergeCounts(previous, delta);
+    }
+
+    TransformTraits traits() const override {
+        TransformTraits traits;
+        traits.counts = CountedQuantity::Lines;
+        traits.outputRatio = 0.0;
+        return traits;
+    }
+
+    void apply(CustomVector& data) override {
+        int numLines = 0;
+        char* read = data.getData();
+        while (*read) {
+            if (*read == '\n') {
+                numLines++;
+            }
+            read++;
+        }
+        char numLinesStr[16];
+        snprintf(numLinesStr, 16, "%d", numLines);
+
+        data.clear();
+
+        for (int i = 0; numLinesStr[i] != '\0'; i++) {
+            data.push_back(numLinesStr[i]);
+        }
+    }
+};
+
+class CountSymbols : public TextTransform {
+public:
+    explicit CountSymbols() = default;
+
+    bool describe(string& description) const override {
+        describeAs(description, "CountSymbols");
+        return true;
+    }
+
+    bool mergeIncremental(const CustomVector& previous, CustomVector& delta) const override {
+        return mergeCounts(previous, delta);
+    }
+
+    TransformTraits traits() const override {
+        TransformTraits traits;
+        traits.counts = CountedQuantity::Bytes;
+        traits.outputRatio = 0.0;
+        return traits;
+    }
+
+    void apply(CustomVector& data) override {
+        int numSymbols = 0;
+        char* read = data.getData();
+        while (*read) {
+            numSymbols++;
+            read++;
+        }
+        char numSymbolsStr[16];
+        snprintf(numSymbolsStr, 16, "%d", numSymbols);
+
+        data.clear();
+
+        for (int i = 0; numSymbolsStr[i] != '\0'; i++) {
+            data.push_back(numSymbolsStr[i]);
+        }
+    }
+};
+
+enum class DistinctMode {
+    Exact,
+    Approximate
+};
+
+class CountDistinct : public TextTransform {
+    DistinctMode mode;
+    HyperLogLog sketch;
+    unordered_set<string_view> seen;
+protected:
+    void record(const char* token, size_t length) {
+        if (mode == DistinctMode::Exact) {
+            seen.insert(string_view(token, length));
+        } else {
+            sketch.add(token, length);
+        }
+    }
+
+    virtual void collect(const char* text, size_t length) = 0;
+    virtual const char* name() const = 0;
+public:
+    explicit CountDistinct(DistinctMode mode, int precision) : mode(mode), sketch(precision) {}
+
+    bool describe(string& description) const override {
+        describeAs(description, name(), { mode == DistinctMode::Exact ? "exact" : "approximate",
+                                          to_string(sketch.getPrecision()) });
+        return true;
+    }
+
+    TransformTraits traits() const override {
+        TransformTraits traits;
+        traits.ignoresFinalNewline = true;
+        traits.costPerByte = 2.0;
+        traits.outputRatio = 0.0;
+        return traits;
+    }
+
+    void apply(CustomVector& data) override {
+        seen.clear();
+        sketch.clear();
+        collect(data.getData(), textLength(data));
+
+        unsigned long long numDistinct = (mode == DistinctMode::Exact)
+                ? seen.size()
+                : llround(sketch.estimate());
+        seen.clear();
+
+        char numDistinctStr[24];
+        snprintf(numDistinctStr, sizeof(numDistinctStr), "%llu", numDistinct);
+
+        data.clear();
+
+        for (int i = 0; numDistinctStr[i] != '\0'; i++) {
+            data.push_back(numDistinctStr[i]);
+        }
+    }
+
+    // Sketch of the most recent apply(); merge sketches of several sources or chunks
+    // with HyperLogLog::merge to estimate the cardinality of their union.
+    const HyperLogLog& getSketch() const {
+        return sketch;
+    }
+};
+
+class CountDistinctLines : public CountDistinct {
+protected:
+    void collect(const char* text, size_t length) override {
+        size_t lineStart = 0;
+        for (size_t i = 0; i < length; ++i) {
+            if (text[i] == '\n') {
+                record(text + lineStart, i - lineStart);
+                lineStart = i + 1;
+            }
+        }
+        if (lineStart < length) {
+            record(text + lineStart, length - lineStart);
+        }
+    }
+    const char* name() const override {
+        return "CountDistinctLines";
+    }
+public:
+    explicit CountDistinctLines(DistinctMode mode = DistinctMode::Exact, int precision = 14)
+            : CountDistinct(mode, precision) {}
+};
+
+class CountDistinctWords : public CountDistinct {
+protected:
+    void collect(const char* text, size_t length) override {
+        size_t i = 0;
+        while (i < length) {
+            while (i < length && isspace(static_cast<unsigned char>(text[i]))) {
+                i++;
+            }
+            size_t wordStart = i;
+            while (i < length && !isspace(static_cast<unsigned char>(text[i]))) {
+                i++;
+            }
+            if (i > wordStart) {
+                record(text + wordStart, i - wordStart);
+            }
+        }
+    }
+    const char* name() const override {
+        return "CountDistinctWords";
+    }
+public:
+    explicit CountDistinctWords(DistinctMode mode = DistinctMode::Exact, int precision = 14)
+            : CountDistinct(mode, precision) {}
+};
+
+// "Name(4:arg1,4:arg2,)" from TextTransform::describe becomes "Name(arg1, arg2)".
+static string transformLabel(const TextTransform* transform) {
+    string description;
+    if (!transform->describe(description)) {
+        return "?";
+    }
+    size_t open = description.find('(');
+    if (open == string::npos) {
+        return description;
+    }
+    string name = description.substr(0, open + 1);
+    size_t pos = open + 1;
+    bool first = true;
+    while (pos < description.size() && description[pos] != ')') {
+        size_t colon = description.find(':', pos);
+        if (colon == string::npos) {
+            break;
+        }
+        size_t length = stoul(description.substr(pos, colon - pos));
+        if (!first) {
+            name += ", ";
+        }
+        name += description.substr(colon + 1, length);
+        first = false;
+        pos = colon + 1 + length + 1;
+    }
+    return name + ')';
+}
+
+// Result of PipelineOptimizer::optimize: the applied rewrites and the estimated cost of the
+// chain before and after, in units of "one cheap pass over the input".
+struct OptimizationReport {
+    vector<string> rewrites;
+    string originalPlan;
+    string optimizedPlan;
+    double originalCost = 0;
+    double optimizedCost = 0;
+
+    void print(ostream& out) const {
+        out << "Plan:      " << originalPlan << '\n';
+        if (rewrites.empty()) {
+            out << "No rewrites apply." << endl;
+            return;
+        }
+        for (const string& rewrite : rewrites) {
+            out << "  - " << rewrite << '\n';
+        }
+        out << "Optimized: " << optimizedPlan << '\n';
+        out.precision(3);
+        out << "Estimated cost " << originalCost << " -> " << optimizedCost << " ("
+            << (originalCost > 0 ? 100.0 * (originalCost - optimizedCost) / originalCost : 0.0)
+            << "% less)" << endl;
+    }
+};
+
+// Rewrites a transform chain into a cheaper one with the same output, using only the
+// properties the transforms declare in traits():
+//  - a line filter moves in front of a sort or dedup, which then has fewer lines to handle;
+//  - a sort next to a dedup fuses into one SortUnique, and a sort or dedup next to a stage
+//    that already sorts or dedups its output is dropped;
+//  - transforms that cannot change what a following count counts are dropped.
+// Moving a filter also moves which stage writes the last line, so it is done only when
+// both stages agree on the final newline or the next stage ignores it. Transforms with a
+// line limit see different lines once others move, fuse or drop, so no rewrite involves them.
+class PipelineOptimizer {
+    vector<unique_ptr<TextTransform>> created;
+
+    static bool isLineSetOperation(LineOperation operation) {
+        return operation == LineOperation::Sort || operation == LineOperation::Dedup ||
+               operation == LineOperation::SortUnique;
+    }
+    static string describePlan(const vector<TextTransform*>& chain) {
+        string plan;
+        for (const TextTransform* transform : chain) {
+            plan += plan.empty() ? "" : " -> ";
+            plan += transformLabel(transform);
+        }
+        return plan.empty() ? "(no transforms)" : plan;
+    }
+
+    static bool movesBefore(const TransformTraits& filter, const TransformTraits& earlier,
+                            const TextTransform* next) {
+        if (filter.lineOperation != LineOperation::Filter || !isLineSetOperation(earlier.lineOperation)) {
+            return false;
+        }
+        return filter.endsWithNewline == earlier.endsWithNewline || (next && next->traits().ignoresFinalNewline);
+    }
+
+    // A sort and a dedup give sorted distinct lines in either order. Sorting or deduplicating
+    // again changes nothing, and a sort or dedup before SortUnique has no effect on its output.
+    bool fuse(vector<TextTransform*>& chain, vector<string>& rewrites) {
+        for (size_t i = 0; i + 1 < chain.size(); ++i) {
+            LineOperation first = chain[i]->traits().lineOperation;
+            LineOperation second = chain[i + 1]->traits().lineOperation;
+            if (!isLineSetOperation(first) || !isLineSetOperation(second) || chain[i]->hasLineLimit() ||
+                chain[i + 1]->hasLineLimit()) {
+                continue;
+            }
+            if (first != second && first != LineOperation::SortUnique && second != LineOperation::SortUnique) {
+                created.push_back(make_unique<SortUnique>());
+                rewrites.push_back("fuse " + transformLabel(chain[i]) + " and " + transformLabel(chain[i + 1]) + " into " +
+                                   transformLabel(created.back().get()));
+                chain[i] = created.back().get();
+                chain.erase(chain.begin() + (i + 1));
+            } else {
+                size_t dropped = (second == LineOperation::SortUnique) ? i : i + 1;
+                rewrites.push_back("drop " + transformLabel(chain[dropped]) + ", " +
+                                   transformLabel(chain[dropped == i ? i + 1 : i]) + " already sorts or dedups");
+                chain.erase(chain.begin() + dropped);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    static bool reorder(vector<TextTransform*>& chain, vector<string>& rewrites) {
+        for (size_t i = 0; i + 1 < chain.size(); ++i) {
+            TransformTraits first = chain[i]->traits();
+            TransformTraits second = chain[i + 1]->traits();
+            const TextTransform* next = (i + 2 < chain.size()) ? chain[i + 2] : nullptr;
+            if (movesBefore(second, first, next) && !chain[i]->hasLineLimit() && !chain[i + 1]->hasLineLimit()) {
+                rewrites.push_back("run " + transformLabel(chain[i + 1]) + " before " + transformLabel(chain[i]));
+                std::swap(chain[i], chain[i + 1]);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool dropUncounted(vector<TextTransform*>& chain, vector<string>& rewrites) {
+        for (size_t i = 1; i < chain.size(); ++i) {
+            CountedQuantity counts = chain[i]->traits().counts;
+            if (counts == CountedQuantity::None || chain[i]->hasLineLimit() || chain[i - 1]->hasLineLimit()) {
+                continue;
+            }
+            TransformTraits previous = chain[i - 1]->traits();
+            if ((counts == CountedQuantity::Lines && previous.preservesLineCount) ||
+                (counts == CountedQuantity::Bytes && previous.preservesLength)) {
+                rewrites.push_back("drop " + transformLabel(chain[i - 1]) + ", it cannot change the result of " +
+                                   transformLabel(chain[i]));
+                chain.erase(chain.begin() + (i - 1));
+                return true;
+            }
+        }
+        return false;
+    }
+public:
+    // Estimated cost per input byte: each stage's cost times the share of the input it sees.
+    static double estimateCost(const vector<TextTransform*>& chain) {
+        double cost = 0;
+        double bytes = 1.0;
+        for (const TextTransform* transform : chain) {
+            TransformTraits traits = transform->traits();
+            cost += traits.costPerByte * bytes;
+            bytes *= traits.outputRatio;
+        }
+        return cost;
+    }
+
+    OptimizationReport optimize(vector<TextTransform*>& chain) {
+        OptimizationReport report;
+        report.originalPlan = describePlan(chain);
+        report.originalCost = estimateCost(chain);
+        // Every rewrite shortens the chain or moves a filter before a sort or dedup, so this
+        // terminates; the bound is only a safeguard.
+        for (size_t round = 0; round < chain.size() * chain.size() + 1; ++round) {
+            if (!fuse(chain, report.rewrites) && !dropUncounted(chain, report.rewrites) &&
+                !reorder(chain, report.rewrites)) {
+                break;
+            }
+        }
+        report.optimizedPlan = describePlan(chain);
+        report.optimizedCost = estimateCost(chain);
+        return report;
+    }
+
+    // Rewrites the first numTransformations entries of transformations in place; the chain
+    // never grows, so numTransformations is updated to the new length.
+    OptimizationReport optimize(TextTransform* transformations[], int& numTransformations) {
+        vector<TextTransform*> chain(transformations, transformations + numTransformations);
+        OptimizationReport report = optimize(chain);
+        copy(chain.begin(), chain.end(), transformations);
+        numTransformations = static_cast<int>(chain.size());
+        return report;
+    }
+};
+
+static void writeJsonString(ostream& out, const string& text) {
+    out << '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out << escaped;
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+// Collects Chrome trace events (chrome://tracing, Perfetto) from all threads while active.
+class TraceRecorder {
+    struct Event {
+        string name;
+        const char* category;
+        char phase;
+        double timestampUs;
+        double durationUs;
+        uint32_t threadId;
+        uint64_t id;
+    };
+
+    static inline atomic<TraceRecorder*> active{nullptr};
+    static inline atomic<uint32_t> nextThreadId{0};
+
+    chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+    atomic<uint64_t> nextAsyncId{0};
+    mutex lock;
+    vector<Event> events;
+
+    void add(Event event) {
+        lock_guard<mutex> guard(lock);
+        events.push_back(move(event));
+    }
+public:
+    TraceRecorder() = default;
+    TraceRecorder(const TraceRecorder& other) = delete;
+    TraceRecorder& operator=(const TraceRecorder& other) = delete;
+
+    ~TraceRecorder() {
+        stop();
+    }
+
+    static TraceRecorder* getActive() {
+        return active.load(memory_order_relaxed);
+    }
+
+    static uint32_t currentThreadId() {
+        static thread_local uint32_t threadId = nextThreadId++;
+        return threadId;
+    }
+
+    void start() {
+        active.store(this);
+    }
+
+    void stop() {
+        TraceRecorder* self = this;
+        active.compare_exchange_strong(self, nullptr);
+    }
+
+    double now() const {
+        return chrono::duration<double, micro>(chrono::steady_clock::now() - epoch).count();
+    }
+
+    void complete(string name, const char* category, double startUs) {
+        add({ move(name), category, 'X', startUs, now() - startUs, currentThreadId(), 0 });
+    }
+
+    // Async spans may start and end on different threads, e.g. a task waiting in a queue.
+    uint64_t beginAsync(const char* name, const char* category) {
+        uint64_t id = ++nextAsyncId;
+        add({ name, category, 'b', now(), 0, currentThreadId(), id });
+        return id;
+    }
+
+    void endAsync(const char* name, const char* category, uint64_t id) {
+        add({ name, category, 'e', now(), 0, currentThreadId(), id });
+    }
+
+    bool writeJson(const char* fileName) {
+        ofstream out(fileName);
+        lock_guard<mutex> guard(lock);
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+        char numbers[96];
+        for (size_t i = 0; i < events.size(); ++i) {
+            const Event& event = events[i];
+            out << (i ? ",\n" : "\n") << "{\"name\": ";
+            writeJsonString(out, event.name);
+            out << ", \"cat\": \"" << event.category << "\", \"ph\": \"" << event.phase << '"';
+            snprintf(numbers, sizeof(numbers), ", \"ts\": %.3f, \"pid\": 1, \"tid\": %u", event.timestampUs,
+                     event.threadId);
+            out << numbers;
+            if (event.phase == 'X') {
+                snprintf(numbers, sizeof(numbers), ", \"dur\": %.3f", event.durationUs);
+                out << numbers;
+            } else {
+                out << ", \"id\": " << event.id;
+            }
+            out << '}';
+        }
+        out << "\n]}" << endl;
+        return static_cast<bool>(out);
+    }
+};
+
+// Records a complete event from construction to the end of the scope. The name is built
+// only while a recorder is active.
+class TraceSpan {
+    TraceRecorder* recorder;
+    const char* category;
+    string name;
+    double startUs = 0;
+public:
+    template <typename MakeName>
+    TraceSpan(const char* category, MakeName makeName) : recorder(TraceRecorder::getActive()), category(category) {
+        if (recorder) {
+            name = makeName();
+            startUs = recorder->now();
+        }
+    }
+
+    TraceSpan(const TraceSpan& other) = delete;
+    TraceSpan& operator=(const TraceSpan& other) = delete;
+
+    ~TraceSpan() {
+        if (recorder) {
+            recorder->complete(move(name), category, startUs);
+        }
+    }
+};
+
+#define HW4_CONCAT_(a, b) a##b
+#define HW4_CONCAT(a, b) HW4_CONCAT_(a, b)
+#if HW4_TRACING
+#define TRACE_SPAN(category, name) TraceSpan HW4_CONCAT(traceSpan, __LINE__)(category, [&]() -> string { return name; })
+#else
+#define TRACE_SPAN(category, name) static_cast<void>(0)
+#endif
+
+// Thread pool in which every worker owns a deque: it runs its own newest tasks first and,
+// when out of work, steals the oldest tasks of other workers. Threads that wait for a
+// TaskGroup run pending tasks meanwhile, so tasks may wait for subtasks without deadlock.
+class WorkStealingPool {
+    struct Worker {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<Worker>> workers;
+    vector<thread> threads;
+    mutex idleLock;
+    condition_variable wakeUp;
+    atomic<size_t> queuedTasks;
+    atomic<size_t> nextQueue;
+    atomic<bool> stopping;
+
+    static inline thread_local WorkStealingPool* currentPool = nullptr;
+    static inline thread_local size_t currentWorker = 0;
+
+    bool takeTask(size_t self, function<void()>& task) {
+        {
+            Worker& own = *workers[self];
+            lock_guard<mutex> guard(own.lock);
+            if (!own.tasks.empty()) {
+                task = move(own.tasks.back());
+                own.tasks.pop_back();
+                queuedTasks--;
+                return true;
+            }
+        }
+        for (size_t offset = 1; offset < workers.size(); ++offset) {
+            Worker& victim = *workers[(self + offset) % workers.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = move(victim.tasks.front());
+                victim.tasks.pop_front();
+                queuedTasks--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(size_t index) {
+        currentPool = this;
+        currentWorker = index;
+        function<void()> task;
+        while (!stopping) {
+            if (takeTask(index, task)) {
+                task();
+                continue;
+            }
+            unique_lock<mutex> guard(idleLock);
+            wakeUp.wait_for(guard, chrono::milliseconds(10), [this] {
+                return queuedTasks > 0 || stopping;
+            });
+        }
+    }
+public:
+    explicit WorkStealingPool(size_t numThreads = thread::hardware_concurrency())
+            : queuedTasks(0), nextQueue(0), stopping(false) {
+        numThreads = max<size_t>(numThreads, 1);
+        for (size_t i = 0; i < numThreads; ++i) {
+            workers.push_back(make_unique<Worker>());
+        }
+        for (size_t i = 0; i < numThreads; ++i) {
+            threads.emplace_back(&WorkStealingPool::workerLoop, this, i);
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool& other) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool& other) = delete;
+
+    ~WorkStealingPool() {
+        stopping = true;
+        wakeUp.notify_all();
+        for (thread& worker : threads) {
+            worker.join();
+        }
+    }
+
+    void submit(function<void()> task) {
+#if HW4_TRACING
+        if (TraceRecorder* recorder = TraceRecorder::getActive()) {
+            uint64_t id = recorder->beginAsync("queued", "queue");
+            task = [recorder, id, task = move(task)] {
+                recorder->endAsync("queued", "queue", id);
+                task();
+            };
+        }
+#endif
+        size_t queue = (currentPool == this) ? currentWorker : nextQueue++ % workers.size();
+        {
+            lock_guard<mutex> guard(workers[queue]->lock);
+            workers[queue]->tasks.push_back(move(task));
+        }
+        queuedTasks++;
+        wakeUp.notify_one();
+    }
+
+    // Runs one queued task on the calling thread; returns false if there was none.
+    bool runPendingTask() {
+        function<void()> task;
+        size_t self = (currentPool == this) ? currentWorker : nextQueue % workers.size();
+        if (!takeTask(self, task)) {
+            return false;
+        }
+        task();
+        return true;
+    }
+
+    size_t getThreadCount() const {
+        return threads.size();
+    }
+};
+
+class TaskGroup {
+    WorkStealingPool& pool;
+    atomic<size_t> pending;
+    mutex doneLock;
+    condition_variable done;
+public:
+    explicit TaskGroup(WorkStealingPool& pool) : pool(pool), pending(0) {}
+
+    TaskGroup(const TaskGroup& other) = delete;
+    TaskGroup& operator=(const TaskGroup& other) = delete;
+
+    ~TaskGroup() {
+        wait();
+    }
+
+    void run(function<void()> task) {
+        pending++;
+        pool.submit([this, task = move(task)] {
+            task();
+            lock_guard<mutex> guard(doneLock);
+            if (--pending == 0) {
+                done.notify_all();
+            }
+        });
+    }
+
+    // Runs queued tasks while there are any and otherwise sleeps until the group finishes.
+    // The sleep is bounded, since a running task may queue subtasks this thread has to help
+    // with. Returns under doneLock, so the last task has finished with the group.
+    void wait() {
+        TRACE_SPAN("wait", "wait for tasks");
+        while (pending > 0) {
+            if (pool.runPendingTask()) {
+                continue;
+            }
+            unique_lock<mutex> guard(doneLock);
+            done.wait_for(guard, chrono::milliseconds(1), [this] {
+                return pending == 0;
+            });
+        }
+        lock_guard<mutex> guard(doneLock);
+    }
+};
+
+#if HW4_HAVE_ZLIB
+// Compresses text as independent gzip members of gzipBlockSize bytes each, as tasks of pool
+// when there is one. Concatenated members are a valid gzip file for gunzip and zlib, like the
+// output of pigz --independent or bgzip. Returns false if zlib fails, e.g. for a bad level.
+static constexpr size_t gzipBlockSize = 1 << 20;
+
+static bool gzipBlocks(const char* text, size_t length, int level, WorkStealingPool* pool, CustomVector& out) {
+    size_t blocks = (length + gzipBlockSize - 1) / gzipBlockSize;
+    vector<string> compressed(blocks);
+    atomic<bool> failed{false};
+    auto compressBlock = [&](size_t block) {
+        size_t begin = block * gzipBlockSize;
+        size_t blockLength = min(gzipBlockSize, length - begin);
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            failed = true;
+            return;
+        }
+        string& result = compressed[block];
+        result.resize(deflateBound(&stream, blockLength));
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(text + begin));
+        stream.avail_in = static_cast<uInt>(blockLength);
+        stream.next_out = reinterpret_cast<Bytef*>(&result[0]);
+        stream.avail_out = static_cast<uInt>(result.size());
+        if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+            failed = true;
+        }
+        result.resize(stream.total_out);
+        deflateEnd(&stream);
+    };
+    if (pool && blocks > 1) {
+        TaskGroup group(*pool);
+        for (size_t block = 0; block < blocks; ++block) {
+            group.run([&compressBlock, block] {
+                compressBlock(block);
+            });
+        }
+    } else {
+        for (size_t block = 0; block < blocks; ++block) {
+            compressBlock(block);
+        }
+    }
+    if (failed) {
+        return false;
+    }
+    for (const string& block : compressed) {
+        out.append(block.data(), block.size());
+    }
+    return true;
+}
+#endif
+
+class TextOutput {
+public:
+    explicit TextOutput() = default;
+    virtual ~TextOutput() = default;
+
+    virtual void writeData(const CustomVector& dataToWrite) = 0;
+
+    // Called before a repeated or incremental run. With append set, the output must keep what
+    // earlier runs wrote and add to it; otherwise it starts over. Returns false if it cannot.
+    virtual bool beginRun(bool append) {
+        return !append;
+    }
+
+    // True if writeData may be called several times in one run, each call adding to what
+    // the earlier ones wrote; the streaming path needs this.
+    virtual bool acceptsChunks() const {
+        return false;
+    }
+
+    // True if the output implements copyFile().
+    virtual bool copiesFiles() const {
+        return false;
+    }
+
+    // Appends the first length bytes of an open file, as writeData would, but copied by the
+    // kernel. The last argument is the file's name, or empty for a temporary file. Returns
+    // false on a write error.
+    virtual bool copyFile(int, uint64_t, const string&) {
+        return false;
+    }
+
+    // Outputs that can split a write into independent parts run them on pool; without one
+    // they write on the calling thread.
+    virtual void setThreadPool(WorkStealingPool*) {}
+};
+
+class TextConsoleOutput : public TextOutput {
+public:
+    explicit TextConsoleOutput() = default;
+
+    void writeData(const CustomVector& dataToWrite) override {
+        cout << dataToWrite;
+    }
+
+    bool beginRun(bool) override {
+        return true;
+    }
+
+    bool acceptsChunks() const override {
+        return true;
+    }
+
+    bool copiesFiles() const override {
+        return fileCopySupported;
+    }
+
+    bool copyFile(int fd, uint64_t length, const string&) override {
+#ifdef HW4_HAVE_MMAP
+        cout.flush();
+        return copyFileBytes(fd, 0, STDOUT_FILENO, appendAtPosition, length) == length;
+#else
+        return false;
+#endif
+    }
+};
+
+// Where TextFileOutput cuts its shards: exactly every maxSizeK bytes, or at the last line
+// (Lines) or word (Words) boundary that fits, falling back to a word boundary and then to a
+// hard cut when a single line or word is longer than a shard.
+enum class SplitMode {
+    Bytes,
+    Lines,
+    Words
+};
+
+class TextFileOutput : public TextOutput {
+    int maxSizeK;
+    const char* fileName;
+    int currFileSize;
+    int fileIndex;
+    ofstream outputFile;
+    bool appendToExisting;
+    SplitMode splitMode;
+    string directory;
+    string pattern;
+    WorkStealingPool* pool;
+    Compression compression;
+    int compressionLevel;
+
+    // "<fileName>_NNN.txt" (".txt.gz" when compressed), or with a pattern, "<directory>/<pattern>" with {} replaced by NNN.
+    string shardName(int index) const {
+        char number[16];
+        snprintf(number, sizeof(number), "%03d", index);
+        if (pattern.empty()) {
+            return string(fileName) + "_" + number + (compression == Compression::Gzip ? ".txt.gz" : ".txt");
+        }
+        string name = pattern;
+        size_t placeholder = name.find("{}");
+        if (placeholder != string::npos) {
+            name.replace(placeholder, 2, number);
+        }
+        return (filesystem::path(directory) / name).string();
+    }
+
+    void openOutput() {
+        if (!directory.empty()) {
+            error_code error;
+            filesystem::create_directories(directory, error);
+        }
+        if (!appendToExisting) {
+            createNewFile();
+            return;
+        }
+        string name = shardName(fileIndex);
+        error_code error;
+        while (filesystem::exists(shardName(fileIndex + 1), error)) {
+            fileIndex++;
+            name = shardName(fileIndex);
+        }
+        // The text size of a compressed shard is unknown, so appending starts the next one.
+        if (compression != Compression::None) {
+            fileIndex += filesystem::exists(name, error) ? 1 : 0;
+            outputFile.open(shardName(fileIndex), ios::binary | ios::trunc);
+            return;
+        }
+        uintmax_t existingSize = filesystem::file_size(name, error);
+        currFileSize = error ? 0 : static_cast<int>(existingSize);
+        outputFile.open(name, ios::app);
+    }
+
+    // Writes one part of a shard, as gzip members when the output is compressed. Shard sizes
+    // count text bytes either way.
+    void writePart(ofstream& shard, const char* text, size_t length) const {
+#if HW4_HAVE_ZLIB
+        if (compression == Compression::Gzip) {
+            CustomVector compressed;
+            if (!gzipBlocks(text, length, compressionLevel, pool, compressed)) {
+                cerr << "Failed to compress output at level " << compressionLevel << "." << endl;
+                return;
+            }
+            shard.write(compressed.getData(), compressed.getSize());
+            return;
+        }
+#endif
+        shard.write(text, length);
+    }
+
+    static bool isWordBreak(char c) {
+        return c == ' ' || c == '\n' || c == '\t';
+    }
+
+    // The offset just past the last newline in [begin, limit), or begin if there is none.
+    static size_t lastLineBreak(const char* text, size_t begin, size_t limit) {
+#ifdef __GLIBC__
+        const void* newline = memrchr(text + begin, '\n', limit - begin);
+        return newline ? static_cast<const char*>(newline) - text + 1 : begin;
+#else
+        for (size_t i = limit; i > begin; --i) {
+            if (text[i - 1] == '\n') {
+                return i;
+            }
+        }
+        return begin;
+#endif
+    }
+
+    // The offset just past the last word break in [begin, limit), or begin if there is none.
+    static size_t lastWordBreak(const char* text, size_t begin, size_t limit) {
+        for (size_t i = limit; i > begin; --i) {
+            if (isWordBreak(text[i - 1])) {
+                return i;
+            }
+        }
+        return begin;
+    }
+
+    // End offsets of the parts data is cut into: the first part fills the current shard, each
+    // further part is a new shard.
+    void planShards(const char* text, size_t length, vector<size_t>& cuts) const {
+        size_t begin = 0;
+        size_t room = (currFileSize < maxSizeK) ? static_cast<size_t>(maxSizeK - currFileSize) : 0;
+        bool freshShard = currFileSize == 0;
+        while (begin < length) {
+            size_t limit = min(length, begin + room);
+            size_t cut = limit;
+            if (limit < length && splitMode != SplitMode::Bytes) {
+                cut = (splitMode == SplitMode::Lines) ? lastLineBreak(text, begin, limit) : lastWordBreak(text, begin, limit);
+                // A shard with room left ends early; an empty one must take a partial line.
+                if (cut == begin && freshShard) {
+                    cut = (splitMode == SplitMode::Lines) ? lastWordBreak(text, begin, limit) : begin;
+                    cut = (cut == begin) ? limit : cut;
+                }
+            }
+            cuts.push_back(cut);
+            begin = cut;
+            room = static_cast<size_t>(maxSizeK);
+            freshShard = true;
+        }
+    }
+public:
+    // A maxSizeK below one byte is raised to one, so every shard makes progress.
+    explicit TextFileOutput(int maxSizeK, const char* fileName = "../output", SplitMode splitMode = SplitMode::Bytes)
+            : TextOutput(), maxSizeK(max(1, maxSizeK)), fileName(fileName), currFileSize(0), fileIndex(0),
+              appendToExisting(false), splitMode(splitMode), pool(nullptr),
+              compression(Compression::None), compressionLevel(6) {}
+
+    TextFileOutput(const TextFileOutput& other) = delete;
+    TextFileOutput& operator=(const TextFileOutput& other) = delete;
+
+    // Writes the shards into directory (created if needed), named by pattern with {} standing
+    // for the three-digit shard number, e.g. "part_{}.log".
+    void setShardNames(const char* shardDirectory, const char* shardPattern) {
+        directory = shardDirectory;
+        pattern = shardPattern;
+    }
+
+    // New shards of one writeData call, and the gzip blocks of each, are written as tasks of pool.
+    void setThreadPool(WorkStealingPool* workStealingPool) override {
+        pool = workStealingPool;
+    }
+
+    // Writes every shard as gzip (level 1-9). Only Compression::None and, in builds with zlib,
+    // Compression::Gzip are supported.
+    void setCompression(Compression format, int level = 6) {
+        compression = format;
+        compressionLevel = level;
+    }
+
+    void createNewFile() {
+        if (outputFile.is_open()) {
+            outputFile.close();
+            fileIndex++;
+        }
+        outputFile.open(shardName(fileIndex));
+    }
+
+    // Appending continues the last existing shard instead of starting over at the first.
+    bool beginRun(bool append) override {
+        appendToExisting = append;
+        if (outputFile.is_open()) {
+            outputFile.close();
+        }
+        fileIndex = 0;
+        currFileSize = 0;
+        return true;
+    }
+
+    bool acceptsChunks() const override {
+        return true;
+    }
+
+    bool copiesFiles() const override {
+        return fileCopySupported && splitMode == SplitMode::Bytes && compression == Compression::None;
+    }
+
+    // Fills the shards exactly as writeData would, with each shard's part copied by the kernel.
+    bool copyFile(int fd, uint64_t length, const string&) override {
+#ifdef HW4_HAVE_MMAP
+        if (!outputFile.is_open()) {
+            openOutput();
+        }
+        outputFile.close();
+        uint64_t copied = 0;
+        bool complete = true;
+        while (copied < length && complete) {
+            if (currFileSize >= maxSizeK) {
+                fileIndex++;
+                currFileSize = 0;
+                ofstream(shardName(fileIndex), ios::trunc);
+            }
+            int shard = ::open(shardName(fileIndex).c_str(), O_WRONLY);
+            uint64_t part = min<uint64_t>(length - copied, static_cast<uint64_t>(maxSizeK - currFileSize));
+            complete = shard >= 0 && copyFileBytes(fd, copied, shard, currFileSize, part) == part;
+            if (shard >= 0) {
+                ::close(shard);
+            }
+            copied += part;
+            currFileSize += static_cast<int>(part);
+        }
+        outputFile.open(shardName(fileIndex), ios::app);
+        return complete;
+#else
+        return false;
+#endif
+    }
+
+    // All shard boundaries are planned first; the first part continues the open shard while
+    // the new shards are written as pool tasks. Compressed parts are also split into blocks.
+    void writeData(const CustomVector& dataToWrite) override {
+        if (!outputFile.is_open()) {
+            openOutput();
+        }
+        const char* text = dataToWrite.getData();
+        vector<size_t> cuts;
+        planShards(text, dataToWrite.getSize(), cuts);
+        if (cuts.empty()) {
+            return;
+        }
+
+        auto writeShard = [this, text, &cuts](size_t part) {
+            ofstream shard(shardName(fileIndex + static_cast<int>(part)), ios::binary | ios::trunc);
+            writePart(shard, text + cuts[part - 1], cuts[part] - cuts[part - 1]);
+        };
+        if (pool && cuts.size() > 2) {
+            TaskGroup group(*pool);
+            for (size_t part = 1; part < cuts.size(); ++part) {
+                group.run([&writeShard, part] {
+                    writeShard(part);
+                });
+            }
+            writePart(outputFile, text, cuts[0]);
+        } else {
+            writePart(outputFile, text, cuts[0]);
+            for (size_t part = 1; part < cuts.size(); ++part) {
+                writeShard(part);
+            }
+        }
+
+        if (cuts.size() == 1) {
+            currFileSize += static_cast<int>(cuts[0]);
+            return;
+        }
+        outputFile.close();
+        fileIndex += static_cast<int>(cuts.size()) - 1;
+        outputFile.open(shardName(fileIndex), ios::app);
+        currFileSize = static_cast<int>(cuts.back() - cuts[cuts.size() - 2]);
+    }
+};
+
+// Writes an inverted index (see InvertedIndex) of the lines of every writeData call of a run.
+// Like ArchiveOutput, it writes the index file once, when the next run begins or the output
+// is destroyed at the end of its task.
+class InvertedIndexOutput : public TextOutput {
+    const char* fileName;
+    uint32_t lineCount;
+    unordered_map<string, vector<uint32_t>> postings;
+    bool indexPending;
+
+    void writeIndex() {
+        vector<const pair<const string, vector<uint32_t>>*> terms;
+        terms.reserve(postings.size());
+        for (const auto& entry : postings) {
+            terms.push_back(&entry);
+        }
+        sort(terms.begin(), terms.end(), [](const auto* a, const auto* b) {
+            return a->first < b->first;
+        });
+
+        CustomVector postingBytes;
+        vector<uint64_t> postingOffsets;
+        const uint64_t headerSize = 32;
+        for (const auto* term : terms) {
+            postingOffsets.push_back(headerSize + postingBytes.getSize());
+            appendVarint(postingBytes, term->second.size());
+            uint32_t previous = 0;
+            for (uint32_t line : term->second) {
+                appendVarint(postingBytes, line - previous);
+                previous = line;
+            }
+        }
+        postingOffsets.push_back(headerSize + postingBytes.getSize());
+
+        uint64_t dictionaryOffset = headerSize + postingBytes.getSize();
+        uint64_t termOffset = dictionaryOffset + terms.size() * 24;
+        CustomVector output;
+        output.append("HW4INDX1", 8);
+        appendRaw<uint64_t>(output, terms.size());
+        appendRaw<uint64_t>(output, lineCount);
+        appendRaw<uint64_t>(output, dictionaryOffset);
+        output.append(postingBytes.getData(), postingBytes.getSize());
+        for (size_t i = 0; i < terms.size(); ++i) {
+            appendRaw<uint64_t>(output, termOffset);
+            appendRaw<uint64_t>(output, postingOffsets[i]);
+            appendRaw<uint32_t>(output, static_cast<uint32_t>(terms[i]->first.size()));
+            appendRaw<uint32_t>(output, static_cast<uint32_t>(postingOffsets[i + 1] - postingOffsets[i]));
+            termOffset += terms[i]->first.size();
+        }
+        for (const auto* term : terms) {
+            output.append(term->first.data(), term->first.size());
+        }
+
+        ofstream indexFile(fileName, ios::binary | ios::trunc);
+        if (!indexFile) {
+            cerr << "Failed to open the index file." << endl;
+            return;
+        }
+        indexFile.write(output.getData(), output.getSize());
+    }
+
+    void finishIndex() {
+        if (indexPending) {
+            writeIndex();
+            indexPending = false;
+        }
+    }
+public:
+    explicit InvertedIndexOutput(const char* fileName)
+            : TextOutput(), fileName(fileName), lineCount(0), indexPending(false) {}
+
+    InvertedIndexOutput(const InvertedIndexOutput& other) = delete;
+    InvertedIndexOutput& operator=(const InvertedIndexOutput& other) = delete;
+
+    ~InvertedIndexOutput() override {
+        finishIndex();
+    }
+
+    // Starting over forgets the lines indexed so far.
+    bool beginRun(bool append) override {
+        finishIndex();
+        if (!append) {
+            postings.clear();
+            lineCount = 0;
+        }
+        return !append;
+    }
+
+    bool acceptsChunks() const override {
+        return true;
+    }
+
+    // Line IDs continue across calls, so several writes index one corpus.
+    void writeData(const CustomVector& dataToWrite) override {
+        const char* text = dataToWrite.getData();
+        size_t length = textLength(dataToWrite);
+        string term;
+        size_t lineStart = 0;
+
+        while (lineStart < length) {
+            const void* newline = memchr(text + lineStart, '\n', length - lineStart);
+            size_t lineEnd = newline ? static_cast<const char*>(newline) - text : length;
+            forEachIndexTerm(text + lineStart, lineEnd - lineStart, term, [&](const string& word) {
+                vector<uint32_t>& lines = postings[word];
+                if (lines.empty() || lines.back() != lineCount) {
+                    lines.push_back(lineCount);
+                }
+            });
+            lineCount++;
+            lineStart = lineEnd + 1;
+        }
+        indexPending = true;
+    }
+};
+
+// Writes an archive (see ArchiveIndex). Every writeData call adds a member named "part-N";
+// in a pipeline without transforms, every file source becomes a member named after the file
+// and is copied by the kernel. The index is written once, after the last member of a run,
+// when the next run begins or the output is destroyed at the end of its task.
+class ArchiveOutput : public TextOutput {
+    const char* fileName;
+    vector<ArchiveIndex::Member> members;
+    uint64_t membersEnd;
+    bool started;
+    bool indexPending;
+
+    void start() {
+        if (!started) {
+            ofstream(fileName, ios::binary | ios::trunc);
+            members.clear();
+            membersEnd = 0;
+            started = true;
+        }
+    }
+
+    void writeIndex() {
+        CustomVector index;
+        ArchiveIndex::write(index, members, membersEnd);
+        {
+            fstream archive(fileName, ios::binary | ios::in | ios::out);
+            if (!archive || !archive.seekp(static_cast<streamoff>(membersEnd)) ||
+                !archive.write(index.getData(), index.getSize())) {
+                cerr << "Failed to write the archive." << endl;
+                return;
+            }
+        }
+        error_code error;
+        filesystem::resize_file(fileName, membersEnd + index.getSize(), error);
+    }
+
+    void finishIndex() {
+        if (indexPending) {
+            writeIndex();
+            indexPending = false;
+        }
+    }
+public:
+    explicit ArchiveOutput(const char* fileName)
+            : TextOutput(), fileName(fileName), membersEnd(0), started(false), indexPending(false) {}
+
+    ArchiveOutput(const ArchiveOutput& other) = delete;
+    ArchiveOutput& operator=(const ArchiveOutput& other) = delete;
+
+    ~ArchiveOutput() override {
+        finishIndex();
+    }
+
+    // Appending adds members to the existing archive.
+    bool beginRun(bool append) override {
+        finishIndex();
+        started = append && ArchiveIndex::read(fileName, members, membersEnd);
+        return started || !append;
+    }
+
+    void writeData(const CustomVector& dataToWrite) override {
+        start();
+        {
+            fstream archive(fileName, ios::binary | ios::in | ios::out);
+            archive.seekp(static_cast<streamoff>(membersEnd));
+            archive.write(dataToWrite.getData(), dataToWrite.getSize());
+        }
+        members.push_back({ "part-" + to_string(members.size() + 1), membersEnd, dataToWrite.getSize(),
+                            hashBytes(dataToWrite.getData(), dataToWrite.getSize()) });
+        membersEnd += dataToWrite.getSize();
+        indexPending = true;
+    }
+
+    bool copiesFiles() const override {
+        return fileCopySupported;
+    }
+
+    bool copyFile(int fd, uint64_t length, const string& name) override {
+#ifdef HW4_HAVE_MMAP
+        start();
+        int archive = ::open(fileName, O_WRONLY);
+        bool copied = archive >= 0 && copyFileBytes(fd, 0, archive, membersEnd, length) == length;
+        if (archive >= 0) {
+            ::close(archive);
+        }
+        MappedFile source;
+        if (!copied || !source.open(fd)) {
+            return false;
+        }
+        string memberName = name.empty() ? "part-" + to_string(members.size() + 1) : name;
+        members.push_back({ memberName, membersEnd, length, hashBytes(source.getData(), min<uint64_t>(length, source.getSize())) });
+        membersEnd += length;
+        indexPending = true;
+        return true;
+#else
+        return false;
+#endif
+    }
+};
+
+struct CacheStats {
+    size_t hits = 0;
+    size_t partialHits = 0;
+    size_t misses = 0;
+    size_t stores = 0;
+    size_t bytesLoaded = 0;
+    size_t bytesStored = 0;
+};
+
+enum class CacheKeyMode {
+    Content,
+    Metadata
+};
+
+// Keeps the output of every transform stage on local disk, keyed by a hash of the source
+// data (or file metadata) combined with the descriptions of the transforms applied so far.
+class ResultCache {
+    string directory;
+    CacheStats stats;
+
+    string entryPath(uint64_t key) const {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.cache", static_cast<unsigned long long>(key));
+        return (filesystem::path(directory) / name).string();
+    }
+public:
+    explicit ResultCache(const char* directory) : directory(directory) {
+        error_code error;
+        filesystem::create_directories(directory, error);
+        if (error) {
+            cerr << "Failed to create the cache directory." << endl;
+        }
+    }
+
+    // Leaves data untouched unless the whole entry is valid.
+    bool load(uint64_t key, CustomVector& data) {
+        string path = entryPath(key);
+        ifstream entry(path, ios::binary);
+        if (!entry) {
+            return false;
+        }
+        char header[24];
+        if (!entry.read(header, sizeof(header)) || memcmp(header, "HW4CACHE", 8) != 0 ||
+            readRaw<uint64_t>(header + 8) != key) {
+            return false;
+        }
+        uint64_t payloadSize = readRaw<uint64_t>(header + 16);
+        error_code error;
+        uintmax_t entrySize = filesystem::file_size(path, error);
+        if (error || payloadSize != entrySize - sizeof(header)) {
+            return false;
+        }
+        CustomVector payload;
+        payload.reserve(payloadSize);
+        char block[1 << 16];
+        while (payload.getSize() < payloadSize &&
+               entry.read(block, min<uint64_t>(sizeof(block), payloadSize - payload.getSize()))) {
+            payload.append(block, entry.gcount());
+        }
+        if (payload.getSize() != payloadSize) {
+            return false;
+        }
+        data.swap(payload);
+        stats.bytesLoaded += payloadSize;
+        return true;
+    }
+
+    void store(uint64_t key, const CustomVector& data) {
+        string path = entryPath(key);
+        string temporaryPath = path + ".tmp";
+        {
+            ofstream entry(temporaryPath, ios::binary | ios::trunc);
+            if (!entry) {
+                cerr << "Failed to write the cache entry." << endl;
+                return;
+            }
+            CustomVector header;
+            header.append("HW4CACHE", 8);
+            appendRaw<uint64_t>(header, key);
+            appendRaw<uint64_t>(header, data.getSize());
+            entry.write(header.getData(), header.getSize());
+            entry.write(data.getData(), data.getSize());
+            if (!entry) {
+                cerr << "Failed to write the cache entry." << endl;
+                return;
+            }
+        }
+        error_code error;
+        filesystem::rename(temporaryPath, path, error);
+        if (error) {
+            filesystem::remove(temporaryPath, error);
+            return;
+        }
+        stats.stores++;
+        stats.bytesStored += data.getSize();
+    }
+
+    void recordLookup(int cachedStages, int totalStages) {
+        if (cachedStages == 0) {
+            stats.misses++;
+        } else if (cachedStages < totalStages) {
+            stats.partialHits++;
+        } else {
+            stats.hits++;
+        }
+    }
+
+    const CacheStats& getStats() const {
+        return stats;
+    }
+
+    void printStats(ostream& os) const {
+        os << "cache: " << stats.hits << " hits, " << stats.partialHits << " partial hits, "
+           << stats.misses << " misses, " << stats.stores << " stores, "
+           << stats.bytesLoaded << " bytes loaded, " << stats.bytesStored << " bytes stored" << endl;
+    }
+};
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int) {
+    stopRequested = 1;
+}
+
+// Reports changes to a set of files. With inotify the parent directories are watched, so
+// files that are replaced by rename (editors, log rotation) keep being noticed; elsewhere
+// the files' sizes and modification times are polled.
+class FileWatcher {
+    struct WatchedFile {
+        filesystem::path path;
+        int directoryWatch;
+        uintmax_t size;
+        filesystem::file_time_type modified;
+    };
+
+    vector<WatchedFile> files;
+    int inotifyFd;
+
+    static void readMetadata(WatchedFile& file) {
+        error_code error;
+        file.size = filesystem::file_size(file.path, error);
+        file.modified = filesystem::last_write_time(file.path, error);
+    }
+
+    bool pollMetadata() {
+        bool changed = false;
+        for (WatchedFile& file : files) {
+            uintmax_t size = file.size;
+            filesystem::file_time_type modified = file.modified;
+            readMetadata(file);
+            changed = changed || size != file.size || modified != file.modified;
+        }
+        return changed;
+    }
+
+#ifdef HW4_HAVE_INOTIFY
+    bool drainEvents(int timeoutMs) {
+        pollfd descriptor = { inotifyFd, POLLIN, 0 };
+        if (poll(&descriptor, 1, timeoutMs) <= 0) {
+            return false;
+        }
+        alignas(inotify_event) char events[4096];
+        bool relevant = false;
+        ssize_t length;
+        while ((length = read(inotifyFd, events, sizeof(events))) > 0) {
+            for (char* read = events; read < events + length;) {
+                auto* event = reinterpret_cast<inotify_event*>(read);
+                for (const WatchedFile& file : files) {
+                    if (event->wd == file.directoryWatch && event->len > 0 &&
+                        file.path.filename() == event->name) {
+                        relevant = true;
+                    }
+                }
+                read += sizeof(inotify_event) + event->len;
+            }
+        }
+        return relevant;
+    }
+#endif
+public:
+    FileWatcher() : inotifyFd(-1) {
+#ifdef HW4_HAVE_INOTIFY
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotifyFd < 0) {
+            cerr << "inotify is unavailable; polling for changes." << endl;
+        }
+#endif
+    }
+
+    FileWatcher(const FileWatcher& other) = delete;
+    FileWatcher& operator=(const FileWatcher& other) = delete;
+
+    ~FileWatcher() {
+#ifdef HW4_HAVE_INOTIFY
+        if (inotifyFd >= 0) {
+            close(inotifyFd);
+        }
+#endif
+    }
+
+    void addFile(const char* fileName) {
+        WatchedFile file = { filesystem::absolute(fileName), -1, 0, {} };
+        readMetadata(file);
+#ifdef HW4_HAVE_INOTIFY
+        if (inotifyFd >= 0) {
+            file.directoryWatch = inotify_add_watch(inotifyFd, file.path.parent_path().c_str(),
+                                                    IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+            if (file.directoryWatch < 0) {
+                cerr << "Failed to watch " << file.path << "." << endl;
+            }
+        }
+#endif
+        files.push_back(file);
+    }
+
+    // Waits up to timeoutMs for a change, then lets further events settle for settleMs so
+    // a burst of writes triggers one run.
+    bool waitForChange(int timeoutMs, int settleMs = 20) {
+#ifdef HW4_HAVE_INOTIFY
+        if (inotifyFd >= 0) {
+            if (!drainEvents(timeoutMs)) {
+                return false;
+            }
+            while (drainEvents(settleMs)) {
+            }
+            pollMetadata();
+            return true;
+        }
+#endif
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+        while (chrono::steady_clock::now() < deadline) {
+            if (pollMetadata()) {
+                this_thread::sleep_for(chrono::milliseconds(settleMs));
+                pollMetadata();
+                return true;
+            }
+            this_thread::sleep_for(chrono::milliseconds(50));
+        }
+        return false;
+    }
+
+    // Latest modification time among the watched files.
+    filesystem::file_time_type lastModified() const {
+        filesystem::file_time_type latest = filesystem::file_time_type::min();
+        for (const WatchedFile& file : files) {
+            latest = max(latest, file.modified);
+        }
+        return latest;
+    }
+};
+
+struct WatchStats {
+    size_t runs = 0;
+    size_t incrementalRuns = 0;
+    double minLatencyMs = 0;
+    double maxLatencyMs = 0;
+    double totalLatencyMs = 0;
+
+    void record(double latencyMs, bool incremental) {
+        minLatencyMs = (runs == 0) ? latencyMs : min(minLatencyMs, latencyMs);
+        maxLatencyMs = max(maxLatencyMs, latencyMs);
+        totalLatencyMs += latencyMs;
+        runs++;
+        if (incremental) {
+            incrementalRuns++;
+        }
+    }
+
+    void print(ostream& os) const {
+        os << "watch: " << runs << " reruns (" << incrementalRuns << " incremental), change-to-output latency ";
+        if (runs == 0) {
+            os << "n/a" << endl;
+            return;
+        }
+        os << "min " << minLatencyMs << " ms, avg " << totalLatencyMs / runs << " ms, max " << maxLatencyMs << " ms" << endl;
+    }
+};
+
+// Peak resident memory since the last reset. Linux resets the high-water mark through
+// /proc/self/clear_refs; elsewhere the process-wide peak from getrusage is reported.
+static void resetPeakResident() {
+#ifdef __linux__
+    ofstream clearRefs("/proc/self/clear_refs");
+    clearRefs << "5";
+#endif
+}
+
+static size_t readPeakResident() {
+#ifdef __linux__
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            return strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+        }
+    }
+#endif
+#ifdef HW4_HAVE_MMAP
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        return usage.ru_maxrss;
+#else
+        return usage.ru_maxrss * 1024;
+#endif
+    }
+#endif
+    return 0;
+}
+
+// Measurements of one pipeline stage: a source read, a transform apply or an output write.
+// CPU time is the whole process's, so it includes the workers of parallel stages.
+struct StageStats {
+    string stage;
+    double wallMs = 0;
+    double cpuMs = 0;
+    size_t bytesIn = 0;
+    size_t bytesOut = 0;
+    uint64_t allocations = 0;
+    size_t peakBuffer = 0;
+    bool hasCounters = false;
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t cacheMisses = 0;
+    uint64_t branchMisses = 0;
+
+    double instructionsPerCycle() const {
+        return cycles ? static_cast<double>(instructions) / cycles : 0;
+    }
+
+    double perInputByte(uint64_t count) const {
+        return bytesIn ? static_cast<double>(count) / bytesIn : 0;
+    }
+};
+
+// User-space cycles, instructions, cache misses and branch misses of the calling thread,
+// from one perf_event_open group per thread that stays open while the thread lives.
+// When the PMU is shared, the group runs only part of the time; Sample::since scales the
+// counts up to the whole interval, as perf stat does.
+class HardwareCounters {
+public:
+    static constexpr int numCounters = 4;
+
+    struct Sample {
+        uint64_t enabledNs = 0;
+        uint64_t runningNs = 0;
+        uint64_t values[numCounters] = {};
+
+        // Estimated counts between start and this sample. False if the group did not run.
+        bool since(const Sample& start, uint64_t counts[numCounters]) const {
+            uint64_t enabled = enabledNs - start.enabledNs;
+            uint64_t running = runningNs - start.runningNs;
+            if (running == 0) {
+                return false;
+            }
+            double scale = static_cast<double>(enabled) / static_cast<double>(running);
+            for (int i = 0; i < numCounters; ++i) {
+                counts[i] = static_cast<uint64_t>(static_cast<double>(values[i] - start.values[i]) * scale);
+            }
+            return true;
+        }
+    };
+private:
+    struct Group {
+        int fds[numCounters] = { -1, -1, -1, -1 };
+        bool opened = false;
+        bool available = false;
+
+        ~Group() {
+            closeAll();
+        }
+
+        void closeAll() {
+#ifdef HW4_HAVE_PERF_EVENTS
+            for (int& fd : fds) {
+                if (fd >= 0) {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+#endif
+        }
+
+        void open() {
+            opened = true;
+#ifdef HW4_HAVE_PERF_EVENTS
+            static const uint64_t events[numCounters] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                          PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+            for (int i = 0; i < numCounters; ++i) {
+                perf_event_attr attr;
+                memset(&attr, 0, sizeof(attr));
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.size = sizeof(attr);
+                attr.config = events[i];
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+                fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, i ? fds[0] : -1, 0));
+                if (fds[i] < 0) {
+                    closeAll();
+                    return;
+                }
+            }
+            available = true;
+#endif
+        }
+    };
+
+    static Group& threadGroup() {
+        static thread_local Group group;
+        if (!group.opened) {
+            group.open();
+        }
+        return group;
+    }
+public:
+    // Running totals; false if counters are unavailable (not Linux, perf_event_paranoid,
+    // no PMU in a virtual machine or container).
+    static bool read(Sample& sample) {
+#ifdef HW4_HAVE_PERF_EVENTS
+        Group& group = threadGroup();
+        // nr, time enabled, time running, then one value per counter.
+        uint64_t buffer[3 + numCounters];
+        if (!group.available || ::read(group.fds[0], buffer, sizeof(buffer)) != sizeof(buffer)) {
+            return false;
+        }
+        sample.enabledNs = buffer[1];
+        sample.runningNs = buffer[2];
+        copy(buffer + 3, buffer + 3 + numCounters, sample.values);
+        return true;
+#else
+        return false;
+#endif
+    }
+};
+
+// Per-stage statistics of the runs of one pipeline, in the order the stages finished.
+class PipelineProfile {
+    vector<StageStats> stages;
+    mutable mutex lock;
+    bool hardwareCounters = false;
+public:
+    // Also samples cycles, instructions, cache and branch misses where the system allows.
+    void setHardwareCounters(bool enabled) {
+        hardwareCounters = enabled;
+    }
+
+    bool countsHardware() const {
+        return hardwareCounters;
+    }
+
+    void record(StageStats stats) {
+        lock_guard<mutex> guard(lock);
+        stages.push_back(move(stats));
+    }
+
+    vector<StageStats> getStages() const {
+        lock_guard<mutex> guard(lock);
+        return stages;
+    }
+
+    void clear() {
+        lock_guard<mutex> guard(lock);
+        stages.clear();
+    }
+
+    void print(ostream& out) const {
+        vector<StageStats> snapshot = getStages();
+        size_t nameWidth = 5;
+        for (const StageStats& stats : snapshot) {
+            nameWidth = max(nameWidth, stats.stage.size());
+        }
+        bool anyCounters = any_of(snapshot.begin(), snapshot.end(), [](const StageStats& stats) {
+            return stats.hasCounters;
+        });
+        char row[200];
+        char counters[80] = "";
+        snprintf(row, sizeof(row), "%10s %10s %12s %12s %9s %8s %12s", "wall ms", "cpu ms", "bytes in",
+                 "bytes out", "MB/s", "allocs", "peak buffer");
+        if (anyCounters) {
+            snprintf(counters, sizeof(counters), " %6s %13s %14s", "IPC", "cache miss/B", "branch miss/B");
+        }
+        out << left << setw(static_cast<int>(nameWidth)) << "stage" << right << ' ' << row << counters << '\n';
+        StageStats total;
+        for (const StageStats& stats : snapshot) {
+            double mbPerSecond = stats.wallMs > 0 ? stats.bytesIn / 1e3 / stats.wallMs : 0;
+            snprintf(row, sizeof(row), "%10.3f %10.3f %12zu %12zu %9.1f %8llu %12zu", stats.wallMs, stats.cpuMs,
+                     stats.bytesIn, stats.bytesOut, mbPerSecond, static_cast<unsigned long long>(stats.allocations),
+                     stats.peakBuffer);
+            if (stats.hasCounters) {
+                snprintf(counters, sizeof(counters), " %6.2f %13.4f %14.4f", stats.instructionsPerCycle(),
+                         stats.perInputByte(stats.cacheMisses), stats.perInputByte(stats.branchMisses));
+            } else if (anyCounters) {
+                snprintf(counters, sizeof(counters), " %6s %13s %14s", "-", "-", "-");
+            }
+            out << left << setw(static_cast<int>(nameWidth)) << stats.stage << right << ' ' << row << counters << '\n';
+            total.wallMs += stats.wallMs;
+            total.cpuMs += stats.cpuMs;
+            total.allocations += stats.allocations;
+            total.peakBuffer = max(total.peakBuffer, stats.peakBuffer);
+        }
+        snprintf(row, sizeof(row), "%10.3f %10.3f %12s %12s %9s %8llu %12zu", total.wallMs, total.cpuMs, "", "", "",
+                 static_cast<unsigned long long>(total.allocations), total.peakBuffer);
+        out << left << setw(static_cast<int>(nameWidth)) << "total" << right << ' ' << row << endl;
+    }
+
+    void writeJson(ostream& out) const {
+        vector<StageStats> snapshot = getStages();
+        out << '[';
+        for (size_t i = 0; i < snapshot.size(); ++i) {
+            const StageStats& stats = snapshot[i];
+            out << (i ? ",\n " : "\n ") << "{\"stage\": ";
+            writeJsonString(out, stats.stage);
+            out << ", \"wall_ms\": " << stats.wallMs << ", \"cpu_ms\": " << stats.cpuMs
+                << ", \"bytes_in\": " << stats.bytesIn << ", \"bytes_out\": " << stats.bytesOut
+                << ", \"allocations\": " << stats.allocations << ", \"peak_buffer\": " << stats.peakBuffer;
+            if (stats.hasCounters) {
+                out << ", \"cycles\": " << stats.cycles << ", \"instructions\": " << stats.instructions
+                    << ", \"cache_misses\": " << stats.cacheMisses << ", \"branch_misses\": " << stats.branchMisses
+                    << ", \"ipc\": " << stats.instructionsPerCycle()
+                    << ", \"cache_misses_per_byte\": " << stats.perInputByte(stats.cacheMisses)
+                    << ", \"branch_misses_per_byte\": " << stats.perInputByte(stats.branchMisses);
+            }
+            out << '}';
+        }
+        out << (snapshot.empty() ? "]" : "\n]");
+    }
+};
+
+// Starts measuring on construction when active; finish() returns the stage's statistics.
+// The peak buffer is the largest buffer allocated during the stage, or its input or output
+// if that is larger.
+// Allocation counts are process-wide, so stages running at the same time on other threads
+// (sibling branches, batch tasks) are attributed to each other. Hardware counters cover only
+// the thread running the stage, so parallel stages report none.
+class StageProbe {
+    bool active;
+    bool counting = false;
+    chrono::steady_clock::time_point wallStart;
+    clock_t cpuStart = 0;
+    uint64_t allocationsStart = 0;
+    HardwareCounters::Sample countersStart;
+public:
+    explicit StageProbe(const PipelineProfile* profile) : active(profile != nullptr) {
+        if (active) {
+            CustomVector::resetLargestAllocation();
+            allocationsStart = CustomVector::getAllocationCount();
+            cpuStart = clock();
+            counting = profile->countsHardware() && HardwareCounters::read(countersStart);
+            wallStart = chrono::steady_clock::now();
+        }
+    }
+
+    bool isActive() const {
+        return active;
+    }
+
+    StageStats finish(string stage, size_t bytesIn, size_t bytesOut) const {
+        StageStats stats;
+        stats.stage = move(stage);
+        stats.wallMs = chrono::duration<double, milli>(chrono::steady_clock::now() - wallStart).count();
+        stats.cpuMs = 1000.0 * static_cast<double>(clock() - cpuStart) / CLOCKS_PER_SEC;
+        stats.bytesIn = bytesIn;
+        stats.bytesOut = bytesOut;
+        stats.allocations = CustomVector::getAllocationCount() - allocationsStart;
+        stats.peakBuffer = max({ CustomVector::getLargestAllocation(), bytesIn, bytesOut });
+        HardwareCounters::Sample sample;
+        uint64_t counters[HardwareCounters::numCounters];
+        if (counting && HardwareCounters::read(sample) && sample.since(countersStart, counters)) {
+            stats.hasCounters = true;
+            stats.cycles = counters[0];
+            stats.instructions = counters[1];
+            stats.cacheMisses = counters[2];
+            stats.branchMisses = counters[3];
+        }
+        return stats;
+    }
+};
+
+// What the memory governor of a TextProcessor did in its last run.
+struct MemoryStats {
+    size_t budget = 0;
+    bool streamed = false;
+    size_t chunks = 0;
+    size_t peakBuffered = 0;    // largest input chunk plus its result held at once
+    size_t spilledBytes = 0;
+    size_t peakResident = 0;    // of the whole process
+
+    void print(ostream& os) const {
+        os << "memory: budget " << budget << " bytes, " << (streamed ? "streamed in " : "in memory")
+           << (streamed ? to_string(chunks) + " chunks" : "") << ", peak buffered " << peakBuffered
+           << " bytes, spilled " << spilledBytes << " bytes, peak resident " << peakResident << " bytes" << endl;
+    }
+};
+
+class TextProcessor {
+    TextSource** sources;
+    int numSources;
+    TextTransform** transformations;
+    int numTransformations;
+    TextOutput** outputs;
+    int numOutputs;
+
+    CustomVector concatData;
+    ResultCache* cache = nullptr;
+    CacheKeyMode cacheKeyMode = CacheKeyMode::Content;
+    WorkStealingPool* pool = nullptr;
+    PipelineProfile* profile = nullptr;
+    size_t memoryBudget = 0;
+    string spillDirectory;
+    MemoryStats memoryStats;
+    string manifestPath;
+    vector<uint64_t> sourceLengths;
+
+    static constexpr size_t minParallelBytes = 256 * 1024;
+    static constexpr size_t minChunkBytes = 64 * 1024;
+    static constexpr size_t minRunBlockBytes = 4096;
+
+    // A branch of a DAG pipeline: it consumes the output of its parent (the processor's own
+    // chain, or another branch) and feeds its own output to its children.
+    struct PipelineBranch {
+        vector<TextTransform*> transformations;
+        vector<TextOutput*> outputs;
+        vector<int> children;
+    };
+
+    vector<PipelineBranch> branches;
+    vector<int> rootBranches;
+
+    // Applies transforms [first, last) of chain, all parallel-safe, to line-aligned chunks of
+    // data on the pool and concatenates the results.
+    void applyParallel(CustomVector& data, TextTransform** chain, int first, int last) {
+        const char* text = data.getData();
+        size_t length = data.getSize();
+        size_t targetChunk = max(minChunkBytes, length / (pool->getThreadCount() * 4));
+
+        vector<pair<size_t, size_t>> chunks;
+        for (size_t start = 0; start < length;) {
+            size_t end = min(length, start + targetChunk);
+            const void* newline = (end < length) ? memchr(text + end, '\n', length - end) : nullptr;
+            end = newline ? static_cast<const char*>(newline) - text + 1 : length;
+            chunks.emplace_back(start, end);
+            start = end;
+        }
+
+        vector<CustomVector> pieces(chunks.size());
+        {
+            TaskGroup group(*pool);
+            for (size_t c = 0; c < chunks.size(); ++c) {
+                group.run([&pieces, &chunks, chain, text, first, last, c] {
+                    pieces[c].append(text + chunks[c].first, chunks[c].second - chunks[c].first);
+                    for (int i = first; i < last; ++i) {
+                        TRACE_SPAN("apply", transformLabel(chain[i]) + " chunk " + to_string(c));
+                        chain[i]->apply(pieces[c]);
+                    }
+                });
+            }
+        }
+
+        size_t total = 0;
+        for (const CustomVector& piece : pieces) {
+            total += piece.getSize();
+        }
+        data.clear();
+        data.reserve(total);
+        for (const CustomVector& piece : pieces) {
+            data.append(piece.getData(), piece.getSize());
+        }
+    }
+
+    void applyStage(CustomVector& data, TextTransform* transform) {
+        TRACE_SPAN("apply", transformLabel(transform));
+        StageProbe probe(profile);
+        size_t bytesIn = data.getSize();
+        transform->apply(data);
+        if (probe.isActive()) {
+            profile->record(probe.finish("apply " + transformLabel(transform), bytesIn, data.getSize()));
+        }
+    }
+
+    // Applies a run of editing transforms to one piece table over data.
+    void applyEdits(CustomVector& data, TextTransform** chain, int first, int last) {
+        PieceTable text(data);
+        for (int i = first; i < last; ++i) {
+            TRACE_SPAN("apply", transformLabel(chain[i]));
+            StageProbe probe(profile);
+            size_t bytesIn = text.getSize();
+            chain[i]->edit(text);
+            if (probe.isActive()) {
+                profile->record(probe.finish("apply " + transformLabel(chain[i]), bytesIn, text.getSize()));
+            }
+        }
+        TRACE_SPAN("apply", "materialize");
+        text.materialize(data);
+    }
+
+    void writeStage(const CustomVector& data, TextOutput* output, const string& label) {
+        TRACE_SPAN("write", "write " + label);
+        StageProbe probe(profile);
+        output->writeData(data);
+        if (probe.isActive()) {
+            profile->record(probe.finish("write " + label, data.getSize(), data.getSize()));
+        }
+    }
+
+    // With a thread pool, runs of consecutive parallel-safe transforms are applied to chunks
+    // of the data concurrently.
+    void applyChain(CustomVector& data, TextTransform** chain, int count) {
+        int i = 0;
+        while (i < count) {
+            int runEnd = i;
+            bool parallel = pool && data.getSize() >= minParallelBytes && textLength(data) == data.getSize();
+            while (parallel && runEnd < count && chain[runEnd]->isParallelSafe()) {
+                runEnd++;
+            }
+            if (runEnd == i && chain[i]->editsText()) {
+                while (runEnd < count && chain[runEnd]->editsText()) {
+                    runEnd++;
+                }
+                applyEdits(data, chain, i, runEnd);
+                i = runEnd;
+            } else if (runEnd > i) {
+                TRACE_SPAN("apply", "parallel run of " + to_string(runEnd - i) + " transforms");
+                StageProbe probe(profile);
+                size_t bytesIn = data.getSize();
+                applyParallel(data, chain, i, runEnd);
+                if (probe.isActive()) {
+                    string label = "apply";
+                    for (int j = i; j < runEnd; ++j) {
+                        label += (j == i ? " " : " + ") + transformLabel(chain[j]);
+                    }
+                    StageStats stats = probe.finish(label + " (parallel)", bytesIn, data.getSize());
+                    // The counters cover this thread only, not the workers.
+                    stats.hasCounters = false;
+                    profile->record(stats);
+                }
+                i = runEnd;
+            } else {
+                applyStage(data, chain[i]);
+                i++;
+            }
+        }
+    }
+
+    // Each branch input is shared by reference count: every branch but the last copies it,
+    // and the last holder takes the buffer over instead of copying. Sibling branches run
+    // concurrently when there is a thread pool.
+    void runBranches(const vector<int>& branchIds, shared_ptr<CustomVector> input) {
+        if (branchIds.empty()) {
+            return;
+        }
+        if (pool && branchIds.size() > 1) {
+            TaskGroup group(*pool);
+            for (size_t i = 0; i + 1 < branchIds.size(); ++i) {
+                // The task hands its reference over, so the branch can see itself as the last
+                // holder.
+                group.run([this, &branchIds, input, i]() mutable {
+                    runBranch(branchIds[i], move(input));
+                });
+            }
+            runBranch(branchIds.back(), move(input));
+            return;
+        }
+        for (size_t i = 0; i + 1 < branchIds.size(); ++i) {
+            runBranch(branchIds[i], input);
+        }
+        runBranch(branchIds.back(), move(input));
+    }
+
+    void runBranch(int branchId, shared_ptr<CustomVector> input) {
+        TRACE_SPAN("branch", "branch " + to_string(branchId));
+        CustomVector data;
+        if (input.use_count() == 1) {
+            // Pairs with the release of the other holders' references: their copies are done.
+            atomic_thread_fence(memory_order_acquire);
+            data.swap(*input);
+        } else {
+            data = *input;
+        }
+        input.reset();
+
+        PipelineBranch& branch = branches[branchId - 1];
+        applyChain(data, branch.transformations.data(), static_cast<int>(branch.transformations.size()));
+        for (size_t i = 0; i < branch.outputs.size(); ++i) {
+            writeStage(data, branch.outputs[i], "branch " + to_string(branchId) + " output " + to_string(i + 1));
+        }
+        if (!branch.children.empty()) {
+            auto shared = make_shared<CustomVector>();
+            shared->swap(data);
+            runBranches(branch.children, move(shared));
+        }
+    }
+
+    void runRootBranches() {
+        if (rootBranches.empty()) {
+            return;
+        }
+        auto shared = make_shared<CustomVector>();
+        shared->swap(concatData);
+        runBranches(rootBranches, move(shared));
+    }
+
+    bool fingerprintSources(uint64_t& key) const {
+        key = 0;
+        for (int i = 0; i < numSources; ++i) {
+            uint64_t sourceKey;
+            if (!sources[i]->fingerprint(sourceKey)) {
+                return false;
+            }
+            key = hashBytes(reinterpret_cast<const char*>(&sourceKey), sizeof(sourceKey), key);
+        }
+        return true;
+    }
+
+    // The longest cached stage is loaded into concatData; the remaining stages are applied
+    // and stored, so a pipeline that shares a prefix with an earlier run reuses it.
+    void processCached() {
+        bool sourcesRead = false;
+        uint64_t key;
+        if (cacheKeyMode != CacheKeyMode::Metadata || !fingerprintSources(key)) {
+            readFromSources();
+            sourcesRead = true;
+            key = hashBytes(concatData.getData(), concatData.getSize());
+        }
+
+        vector<uint64_t> stageKeys(1, key);
+        string description;
+        for (int i = 0; i < numTransformations; ++i) {
+            description.clear();
+            if (!transformations[i]->describe(description)) {
+                break;
+            }
+            stageKeys.push_back(hashBytes(description.data(), description.size(), stageKeys.back()));
+        }
+        int describedStages = static_cast<int>(stageKeys.size()) - 1;
+
+        int cachedStages = 0;
+        for (int stage = describedStages; stage > 0; --stage) {
+            if (cache->load(stageKeys[stage], concatData)) {
+                cachedStages = stage;
+                break;
+            }
+        }
+        cache->recordLookup(cachedStages, numTransformations);
+
+        if (cachedStages == 0 && !sourcesRead) {
+            readFromSources();
+        }
+        for (int i = cachedStages; i < numTransformations; ++i) {
+            applyStage(concatData, transformations[i]);
+            if (i < describedStages) {
+                cache->store(stageKeys[i + 1], concatData);
+            }
+        }
+    }
+    // Incremental state: per source, the offset of the first unprocessed byte (always just
+    // after a newline) and a checksum of the incrementalTailBytes before it.
+    struct SourceState {
+        string fileName;
+        uint64_t offset = 0;
+        uint64_t fileSize = 0;      // size and modification time when the state was saved
+        int64_t modified = 0;
+        uint64_t tailChecksum = 0;
+    };
+
+    static constexpr uint64_t incrementalTailBytes = 1 << 20;
+
+    bool describeChain(uint64_t& chainHash) const {
+        string description;
+        for (int i = 0; i < numTransformations; ++i) {
+            if (!transformations[i]->describe(description)) {
+                return false;
+            }
+        }
+        chainHash = hashBytes(description.data(), description.size());
+        return true;
+    }
+
+    static bool loadIncrementalState(const string& statePath, uint64_t chainHash, vector<SourceState>& states) {
+        MappedFile stateFile;
+        error_code error;
+        if (!filesystem::exists(statePath, error) || !stateFile.open(statePath.c_str())) {
+            return false;
+        }
+        const char* read = stateFile.getData();
+        const char* end = read + stateFile.getSize();
+        if (end - read < 28 || memcmp(read, "HW4INCR3", 8) != 0 || readRaw<uint64_t>(read + 8) != chainHash ||
+            readRaw<uint64_t>(read + 16) != incrementalTailBytes) {
+            return false;
+        }
+        uint32_t numStates = readRaw<uint32_t>(read + 24);
+        read += 28;
+        states.clear();
+        for (uint32_t i = 0; i < numStates; ++i) {
+            SourceState state;
+            uint64_t nameLen;
+            if (!readVarint(read, end, nameLen) || static_cast<uint64_t>(end - read) < nameLen) {
+                return false;
+            }
+            state.fileName.assign(read, nameLen);
+            read += nameLen;
+            uint64_t modified;
+            if (!readVarint(read, end, state.offset) || !readVarint(read, end, state.fileSize) ||
+                !readVarint(read, end, modified) || end - read < 8) {
+                return false;
+            }
+            state.modified = static_cast<int64_t>(modified);
+            state.tailChecksum = readRaw<uint64_t>(read);
+            read += 8;
+            states.push_back(state);
+        }
+        return true;
+    }
+
+    static void saveIncrementalState(const string& statePath, uint64_t chainHash, const vector<SourceState>& states) {
+        CustomVector stateBytes;
+        stateBytes.append("HW4INCR3", 8);
+        appendRaw<uint64_t>(stateBytes, chainHash);
+        appendRaw<uint64_t>(stateBytes, incrementalTailBytes);
+        appendRaw<uint32_t>(stateBytes, static_cast<uint32_t>(states.size()));
+        for (const SourceState& state : states) {
+            appendVarint(stateBytes, state.fileName.size());
+            stateBytes.append(state.fileName.data(), state.fileName.size());
+            appendVarint(stateBytes, state.offset);
+            appendVarint(stateBytes, state.fileSize);
+            appendVarint(stateBytes, static_cast<uint64_t>(state.modified));
+            appendRaw<uint64_t>(stateBytes, state.tailChecksum);
+        }
+        writeWholeFile(statePath, stateBytes);
+    }
+
+    static bool writeWholeFile(const string& path, const CustomVector& bytes) {
+        ofstream file(path, ios::binary | ios::trunc);
+        if (!file || !file.write(bytes.getData(), bytes.getSize())) {
+            cerr << "Failed to write " << path << "." << endl;
+            return false;
+        }
+        return true;
+    }
+
+    static bool readMetadata(const string& fileName, uint64_t& fileSize, int64_t& modified) {
+        error_code error;
+        fileSize = filesystem::file_size(fileName, error);
+        if (error) {
+            return false;
+        }
+        auto writeTime = filesystem::last_write_time(fileName, error);
+        modified = error ? 0 : static_cast<int64_t>(writeTime.time_since_epoch().count());
+        return true;
+    }
+
+    // Sources are expected to grow by appending, so only a shrunk file or a change to the
+    // last incrementalTailBytes processed is detected; an edit earlier in the processed data
+    // is not. An untouched file is recognized from its size and modification time, otherwise
+    // the tail is checksummed again. This costs at most one tail per run, however large the
+    // processed prefix.
+    static bool unchangedPrefix(const SourceState& state) {
+        uint64_t fileSize;
+        int64_t modified;
+        if (!readMetadata(state.fileName, fileSize, modified) || fileSize < state.offset) {
+            return false;
+        }
+        if ((fileSize == state.fileSize && modified == state.modified) || state.offset == 0) {
+            return true;
+        }
+        uint64_t tailStart = state.offset - min(state.offset, incrementalTailBytes);
+        string bytes(state.offset - tailStart, '\0');
+        ifstream file(state.fileName, ios::binary);
+        if (!file.seekg(static_cast<streamoff>(tailStart)) || !file.read(&bytes[0], bytes.size())) {
+            return false;
+        }
+        return hashBytes(bytes.data(), bytes.size()) == state.tailChecksum;
+    }
+
+    // Everything up to the last newline of the file from chunkStart on; the tail of an
+    // unterminated last line waits for a later run.
+    static size_t completeLinesLength(const char* bytes, size_t length) {
+        while (length > 0 && bytes[length - 1] != '\n') {
+            length--;
+        }
+        return length;
+    }
+
+    string sourceName(int index) const {
+        auto* fileSource = dynamic_cast<TextFileSource*>(sources[index]);
+        return fileSource ? string(fileSource->getFileName()) : "source " + to_string(index + 1);
+    }
+
+    // One line per source: its offset and length in the concatenated output, and its name.
+    void writeManifest() const {
+        if (manifestPath.empty()) {
+            return;
+        }
+        if (numTransformations > 0) {
+            cerr << "A manifest is only written for pipelines without transforms." << endl;
+            return;
+        }
+        ofstream manifest(manifestPath);
+        uint64_t offset = 0;
+        for (int i = 0; i < numSources && i < static_cast<int>(sourceLengths.size()); ++i) {
+            manifest << offset << '\t' << sourceLengths[i] << '\t' << sourceName(i) << '\n';
+            offset += sourceLengths[i];
+        }
+        if (!manifest) {
+            cerr << "Cannot write manifest " << manifestPath << endl;
+        }
+    }
+
+    // Archiving: without transforms, file sources are concatenated into outputs that can copy
+    // files by the kernel, so the data never passes through the process. Returns false, before
+    // writing anything, if the pipeline does not qualify.
+    bool processArchive() {
+        if (numTransformations > 0 || cache || !branches.empty() || numOutputs == 0) {
+            return false;
+        }
+        for (int i = 0; i < numOutputs; ++i) {
+            if (!outputs[i]->copiesFiles()) {
+                return false;
+            }
+        }
+        for (int i = 0; i < numSources; ++i) {
+            auto* fileSource = dynamic_cast<TextFileSource*>(sources[i]);
+            if (!fileSource || fileSource->isCompressed()) {
+                return false;
+            }
+        }
+#ifdef HW4_HAVE_MMAP
+        for (int i = 0; i < numSources; ++i) {
+            string name = sourceName(i);
+            int fd = ::open(name.c_str(), O_RDONLY);
+            struct stat info;
+            if (fd < 0 || fstat(fd, &info) != 0) {
+                cerr << "Failed to open the file." << endl;
+                sourceLengths.push_back(0);
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+                continue;
+            }
+            uint64_t length = static_cast<uint64_t>(info.st_size);
+            sourceLengths.push_back(length);
+            for (int j = 0; j < numOutputs; ++j) {
+                TRACE_SPAN("write", "copy " + name + " to output " + to_string(j + 1));
+                StageProbe probe(profile);
+                if (!outputs[j]->copyFile(fd, length, name)) {
+                    cerr << "Failed to copy " << name << " to output " << (j + 1) << endl;
+                }
+                if (probe.isActive()) {
+                    profile->record(probe.finish("copy " + name + " to output " + to_string(j + 1), length, length));
+                }
+            }
+            ::close(fd);
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Input, result and a copy are alive at once while a stage runs.
+    static constexpr size_t bufferCopiesPerStage = 3;
+
+    bool exceedsMemoryBudget() const {
+        if (memoryBudget == 0) {
+            return false;
+        }
+        size_t inputBytes = 0;
+        for (int i = 0; i < numSources; ++i) {
+            if (auto* fileSource = dynamic_cast<TextFileSource*>(sources[i])) {
+                inputBytes += fileSource->estimateSize();
+            }
+        }
+        return inputBytes > memoryBudget / bufferCopiesPerStage;
+    }
+
+    // A new file name in spillDirectory (default: the system's temporary directory).
+    string spillFileName() const {
+        filesystem::path directory = spillDirectory.empty() ? filesystem::temp_directory_path()
+                                                            : filesystem::path(spillDirectory);
+        return (directory / ("hw4_spill_" + to_string(reinterpret_cast<uintptr_t>(this)) + "_" +
+                             to_string(chrono::steady_clock::now().time_since_epoch().count()))).string();
+    }
+
+    // One sorted run in a spill file, read back a block at a time while the runs are merged.
+    struct SpilledRun {
+        uint64_t next = 0;      // offset of the first byte not read yet
+        uint64_t end = 0;
+        string buffer;
+        size_t lineStart = 0;
+        string_view line;
+    };
+
+    // Moves run to its next line, reading blocks of blockBytes as needed. Returns false when
+    // the run is used up.
+    static bool nextRunLine(ifstream& file, SpilledRun& run, size_t blockBytes) {
+        size_t lineEnd;
+        while ((lineEnd = run.buffer.find('\n', run.lineStart)) == string::npos && run.next < run.end) {
+            run.buffer.erase(0, run.lineStart);
+            run.lineStart = 0;
+            size_t kept = run.buffer.size();
+            size_t block = static_cast<size_t>(min<uint64_t>(blockBytes, run.end - run.next));
+            run.buffer.resize(kept + block);
+            file.seekg(static_cast<streamoff>(run.next));
+            if (!file.read(&run.buffer[kept], static_cast<streamsize>(block))) {
+                cerr << "Failed to read the spill file." << endl;
+                run.buffer.resize(kept + static_cast<size_t>(file.gcount()));
+                run.next = run.end;
+                file.clear();
+                continue;
+            }
+            run.next += block;
+        }
+        if (lineEnd == string::npos) {
+            if (run.lineStart >= run.buffer.size()) {
+                return false;
+            }
+            lineEnd = run.buffer.size();
+        }
+        run.line = string_view(run.buffer).substr(run.lineStart, lineEnd - run.lineStart);
+        run.lineStart = lineEnd + 1;
+        return true;
+    }
+
+    // Merges the runs of global's output spilled to the given byte ranges of the file at path,
+    // line by line with global's sortKey() and combineLines(), and hands the result to write
+    // in chunks of about chunkBytes that end in a newline.
+    bool mergeSpilledRuns(const string& path, const vector<pair<uint64_t, uint64_t>>& ranges,
+                          const TextTransform* global, size_t chunkBytes, const function<void(CustomVector&)>& write) {
+        ifstream file(path, ios::binary);
+        if (!file) {
+            cerr << "Cannot read spill file " << path << endl;
+            return false;
+        }
+        size_t blockBytes = max(minRunBlockBytes, chunkBytes / max<size_t>(1, ranges.size()));
+        vector<SpilledRun> runs(ranges.size());
+        // Equal keys come out in run order, as they would from one apply().
+        auto later = [&](size_t a, size_t b) {
+            int order = global->sortKey(runs[a].line).compare(global->sortKey(runs[b].line));
+            return order > 0 || (order == 0 && a > b);
+        };
+        priority_queue<size_t, vector<size_t>, decltype(later)> heads(later);
+        for (size_t i = 0; i < runs.size(); ++i) {
+            runs[i].next = ranges[i].first;
+            runs[i].end = ranges[i].first + ranges[i].second;
+            if (nextRunLine(file, runs[i], blockBytes)) {
+                heads.push(i);
+            }
+        }
+        memoryStats.peakBuffered = max(memoryStats.peakBuffered, runs.size() * blockBytes + chunkBytes);
+
+        CustomVector chunk;
+        bool written = false;
+        string kept;
+        bool haveKept = false;
+        auto emitKept = [&] {
+            if (chunk.getSize() >= chunkBytes) {
+                write(chunk);
+                chunk.clear();
+                written = true;
+            }
+            chunk.append(kept.data(), kept.size());
+            chunk.push_back('\n');
+        };
+        while (!heads.empty()) {
+            size_t i = heads.top();
+            heads.pop();
+            if (!haveKept || global->sortKey(kept) != global->sortKey(runs[i].line) ||
+                !global->combineLines(kept, runs[i].line)) {
+                if (haveKept) {
+                    emitKept();
+                }
+                kept.assign(runs[i].line.data(), runs[i].line.size());
+                haveKept = true;
+            }
+            if (nextRunLine(file, runs[i], blockBytes)) {
+                heads.push(i);
+            }
+        }
+        // Like apply(), the merged output has no final newline.
+        if (haveKept) {
+            emitKept();
+            chunk.resize(chunk.getSize() - 1);
+        }
+        if (chunk.getSize() > 0 || !written) {
+            write(chunk);
+        }
+        return true;
+    }
+
+    // Streams the file sources, decompressed if need be, through the pipeline in line-aligned
+    // chunks sized to the memory budget. The chain must be split-safe apart from a last
+    // transform that can merge partial results. Sorted results (sort | uniq) are spilled as
+    // one sorted run per chunk and merged line by line into the outputs; other merged results
+    // (counts) are held in memory and must fit the budget. Outputs that cannot take several
+    // writes get the result from a spill file at the end, copied by the kernel where they
+    // can. Transforms with a line limit do not stream. Returns false, before writing any
+    // output, if the pipeline cannot stream.
+    bool processStreaming() {
+        vector<TextFileSource*> fileSources;
+        for (int i = 0; i < numSources; ++i) {
+            auto* fileSource = dynamic_cast<TextFileSource*>(sources[i]);
+            if (!fileSource) {
+                return false;
+            }
+            fileSources.push_back(fileSource);
+        }
+        for (int i = 0; i < numTransformations; ++i) {
+            if (transformations[i]->hasLineLimit()) {
+                return false;
+            }
+        }
+        int splitSafeStages = 0;
+        while (splitSafeStages < numTransformations && transformations[splitSafeStages]->isSplitSafe()) {
+            splitSafeStages++;
+        }
+        if (splitSafeStages + 1 < numTransformations) {
+            return false;
+        }
+        TextTransform* global = (splitSafeStages < numTransformations) ? transformations[splitSafeStages] : nullptr;
+        bool sortedRuns = global && global->mergesSortedRuns();
+
+        vector<TextOutput*> spilledOutputs;
+        for (int i = 0; i < numOutputs && (!global || sortedRuns); ++i) {
+            if (!outputs[i]->acceptsChunks()) {
+                spilledOutputs.push_back(outputs[i]);
+            }
+        }
+        string spillPath;
+        ofstream spill;
+        uint64_t spillLength = 0;
+        if (!spilledOutputs.empty()) {
+            spillPath = spillFileName();
+            spill.open(spillPath, ios::binary);
+            if (!spill) {
+                cerr << "Cannot create spill file " << spillPath << endl;
+                return false;
+            }
+        }
+        string runsPath;
+        ofstream runsFile;
+        vector<pair<uint64_t, uint64_t>> runs;
+        uint64_t runsEnd = 0;
+        if (sortedRuns) {
+            runsPath = spillFileName() + "_runs";
+            runsFile.open(runsPath, ios::binary);
+            if (!runsFile) {
+                cerr << "Cannot create spill file " << runsPath << endl;
+                return false;
+            }
+        }
+
+        // Hands a piece of the final result to the outputs that take it in pieces, and to the
+        // spill file for the others.
+        auto writeChunk = [&](CustomVector& chunk) {
+            for (int i = 0; i < numOutputs; ++i) {
+                if (outputs[i]->acceptsChunks()) {
+                    writeStage(chunk, outputs[i], "output " + to_string(i + 1));
+                }
+            }
+            if (spill.is_open()) {
+                spill.write(chunk.getData(), chunk.getSize());
+                spillLength += chunk.getSize();
+                memoryStats.spilledBytes += chunk.getSize();
+            }
+        };
+
+        size_t chunkBytes = max(minChunkBytes, memoryBudget / (2 * bufferCopiesPerStage));
+        CustomVector merged;
+        bool haveMerged = false;
+        bool mergeable = true;
+        auto processChunk = [&](CustomVector& chunk) {
+            memoryStats.chunks++;
+            size_t chunkSize = chunk.getSize();
+            applyChain(chunk, transformations, splitSafeStages);
+            if (sortedRuns) {
+                applyStage(chunk, global);
+                size_t runLength = textLength(chunk);
+                runsFile.write(chunk.getData(), runLength);
+                runs.push_back({ runsEnd, runLength });
+                runsEnd += runLength;
+                memoryStats.spilledBytes += runLength;
+                memoryStats.peakBuffered = max(memoryStats.peakBuffered, chunkSize + chunk.getSize());
+                return;
+            }
+            if (global) {
+                applyStage(chunk, global);
+                if (haveMerged && !global->mergeIncremental(merged, chunk)) {
+                    mergeable = false;
+                }
+                merged.swap(chunk);
+                haveMerged = true;
+                memoryStats.peakBuffered = max(memoryStats.peakBuffered, chunkSize + merged.getSize());
+                if (merged.getSize() > memoryBudget / bufferCopiesPerStage) {
+                    mergeable = false;
+                }
+                return;
+            }
+            memoryStats.peakBuffered = max(memoryStats.peakBuffered, chunkSize + chunk.getSize());
+            writeChunk(chunk);
+        };
+
+        // Chunks end at a newline; the incomplete last line waits in pending for more input,
+        // which may come from the next source.
+        CustomVector pending;
+        for (size_t i = 0; i < fileSources.size() && mergeable; ++i) {
+            uint64_t offset = 0;
+            fileSources[i]->rewind();
+            while (mergeable) {
+                {
+                    TRACE_SPAN("read", "read " + string(fileSources[i]->getFileName()) + " at " + to_string(offset));
+                    StageProbe probe(profile);
+                    if (!fileSources[i]->readChunk(chunkBytes)) {
+                        break;
+                    }
+                    if (probe.isActive()) {
+                        profile->record(probe.finish("read " + string(fileSources[i]->getFileName()),
+                                                     fileSources[i]->getSize(), fileSources[i]->getSize()));
+                    }
+                }
+                size_t got = fileSources[i]->getSize();
+                if (got == 0) {
+                    break;
+                }
+                offset += got;
+                pending.append(fileSources[i]->getData(), got);
+                size_t complete = completeLinesLength(pending.getData(), pending.getSize());
+                if (complete == 0) {
+                    continue;
+                }
+                CustomVector chunk;
+                chunk.append(pending.getData(), complete);
+                CustomVector rest;
+                rest.append(pending.getData() + complete, pending.getSize() - complete);
+                pending.swap(rest);
+                processChunk(chunk);
+            }
+        }
+        if (pending.getSize() > 0 && mergeable) {
+            processChunk(pending);
+        }
+
+        error_code error;
+        if (!mergeable) {
+            if (spill.is_open()) {
+                spill.close();
+                filesystem::remove(spillPath, error);
+            }
+            return false;
+        }
+        if (sortedRuns) {
+            runsFile.close();
+            TRACE_SPAN("merge", "merge " + to_string(runs.size()) + " sorted runs");
+            // Too many runs for a read buffer each within the budget are merged in groups first.
+            size_t mergeWidth = max<size_t>(2, chunkBytes / minRunBlockBytes);
+            while (runs.size() > mergeWidth) {
+                string passPath = spillFileName() + "_runs";
+                ofstream passFile(passPath, ios::binary);
+                vector<pair<uint64_t, uint64_t>> passRuns;
+                uint64_t passEnd = 0;
+                for (size_t first = 0; first < runs.size(); first += mergeWidth) {
+                    vector<pair<uint64_t, uint64_t>> group(runs.begin() + first,
+                                                           runs.begin() + min(runs.size(), first + mergeWidth));
+                    uint64_t groupStart = passEnd;
+                    mergeSpilledRuns(runsPath, group, global, chunkBytes, [&](CustomVector& piece) {
+                        passFile.write(piece.getData(), piece.getSize());
+                        passEnd += piece.getSize();
+                    });
+                    passRuns.push_back({ groupStart, passEnd - groupStart });
+                }
+                passFile.close();
+                filesystem::remove(runsPath, error);
+                runsPath = passPath;
+                runs.swap(passRuns);
+                memoryStats.spilledBytes += passEnd;
+            }
+            mergeSpilledRuns(runsPath, runs, global, chunkBytes, writeChunk);
+            filesystem::remove(runsPath, error);
+        } else if (global) {
+            for (int i = 0; i < numOutputs; ++i) {
+                writeStage(merged, outputs[i], "output " + to_string(i + 1));
+            }
+        }
+        if (spill.is_open()) {
+            spill.close();
+            writeSpilledOutputs(spillPath, spillLength, spilledOutputs);
+            filesystem::remove(spillPath, error);
+        }
+        memoryStats.streamed = true;
+        return true;
+    }
+
+    // Gives the length bytes of result spilled to path to the outputs that take it in one
+    // piece: copied by the kernel into outputs that can, and otherwise read once into memory.
+    void writeSpilledOutputs(const string& path, uint64_t length, const vector<TextOutput*>& spilledOutputs) {
+        CustomVector result;
+        bool loaded = false;
+        for (size_t i = 0; i < spilledOutputs.size(); ++i) {
+            string label = "spilled output " + to_string(i + 1);
+#ifdef HW4_HAVE_MMAP
+            if (spilledOutputs[i]->copiesFiles()) {
+                TRACE_SPAN("write", "copy " + label);
+                int fd = ::open(path.c_str(), O_RDONLY);
+                if (fd < 0 || !spilledOutputs[i]->copyFile(fd, length, "")) {
+                    cerr << "Failed to copy the spilled result to " << label << endl;
+                }
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+                continue;
+            }
+#endif
+            if (!loaded) {
+                if (length > memoryBudget / bufferCopiesPerStage) {
+                    cerr << "Loading the spilled result exceeds the memory budget; outputs that take the "
+                            "result in one piece cannot stream." << endl;
+                }
+                ifstream spilled(path, ios::binary);
+                result.resize(static_cast<size_t>(length));
+                if (!spilled.read(result.getData(), static_cast<streamsize>(length))) {
+                    cerr << "Failed to read the spill file." << endl;
+                    result.resize(static_cast<size_t>(spilled.gcount()));
+                }
+                loaded = true;
+            }
+            writeStage(result, spilledOutputs[i], label);
+        }
+    }
 public:
     TextProcessor(TextSource* sources[],
                   int numSources,
@@ -685,43 +5946,2317 @@ public:
                       outputs(outputs),
                       numOutputs(numOutputs) {}
 
-    void concatenate(const char* data) {
-        size_t dataLen = strlen(data);
-        for (int i = 0; i < dataLen; ++i) {
-            concatData.push_back(data[i]);
+    void concatenate(const char* data) {
+        size_t dataLen = strlen(data);
+        for (int i = 0; i < dataLen; ++i) {
+            concatData.push_back(data[i]);
+        }
+    }
+
+    void readFromSources() {
+        for (int i = 0; i < numSources; ++i) {
+            TRACE_SPAN("read", "read source " + to_string(i + 1));
+            StageProbe probe(profile);
+            size_t sizeBefore = concatData.getSize();
+            sources[i]->readData();
+            const char* data = sources[i]->getData();
+            if(data) {
+                concatenate(data);
+            }
+            sourceLengths.push_back(concatData.getSize() - sizeBefore);
+            if (probe.isActive()) {
+                auto* fileSource = dynamic_cast<TextFileSource*>(sources[i]);
+                string label = "read " + (fileSource ? string(fileSource->getFileName()) : "source " + to_string(i + 1));
+                size_t bytes = concatData.getSize() - sizeBefore;
+                profile->record(probe.finish(label, bytes, bytes));
+            }
+        }
+    }
+
+    void applyTransformations() {
+        applyChain(concatData, transformations, numTransformations);
+    }
+
+    void outputSources() {
+        for (int i = 0; i < numOutputs; ++i) {
+            writeStage(concatData, outputs[i], "output " + to_string(i + 1));
+        }
+    }
+
+    // Processes only what was appended to the file sources since the last run recorded in
+    // statePath. A chain of split-safe transforms appends its output for the new lines to the
+    // outputs; a chain ending in one transform that supports mergeIncremental (sort, dedup,
+    // count) merges with the persisted result and rewrites the outputs. Anything else, or a
+    // change to already processed data, falls back to a full run that records new state.
+    // Only complete lines are consumed. Returns true if the incremental path was taken.
+    bool processIncremental(const char* statePath) {
+        if (!branches.empty()) {
+            processFully();
+            return false;
+        }
+        vector<TextFileSource*> fileSources;
+        for (int i = 0; i < numSources; ++i) {
+            auto* fileSource = dynamic_cast<TextFileSource*>(sources[i]);
+            if (!fileSource || fileSource->isCompressed()) {
+                processFully();
+                return false;
+            }
+            fileSources.push_back(fileSource);
+        }
+        uint64_t chainHash;
+        if (!describeChain(chainHash)) {
+            processFully();
+            return false;
+        }
+        int splitSafeStages = 0;
+        while (splitSafeStages < numTransformations && transformations[splitSafeStages]->isSplitSafe()) {
+            splitSafeStages++;
+        }
+        if (numTransformations - splitSafeStages > 1) {
+            processFully();
+            return false;
+        }
+        TextTransform* global = (splitSafeStages < numTransformations) ? transformations[splitSafeStages] : nullptr;
+        if (global && global->hasLineLimit()) {
+            processFully();
+            return false;
+        }
+        string stagePath = string(statePath) + ".stage";
+
+        vector<SourceState> states;
+        bool incremental = loadIncrementalState(statePath, chainHash, states) && states.size() == fileSources.size();
+        for (size_t i = 0; incremental && i < fileSources.size(); ++i) {
+            incremental = states[i].fileName == fileSources[i]->getFileName() && unchangedPrefix(states[i]);
+        }
+        CustomVector previousStage;
+        if (incremental && global) {
+            MappedFile stageFile;
+            error_code error;
+            incremental = filesystem::exists(stagePath, error) && stageFile.open(stagePath.c_str());
+            if (incremental) {
+                previousStage.append(stageFile.getData(), stageFile.getSize());
+            }
+        }
+        for (int i = 0; incremental && !global && i < numOutputs; ++i) {
+            incremental = outputs[i]->beginRun(true);
+        }
+        if (!incremental) {
+            states.assign(fileSources.size(), SourceState());
+        }
+        // A merged result replaces the previous one in the outputs.
+        if (!incremental || global) {
+            for (int i = 0; i < numOutputs; ++i) {
+                outputs[i]->beginRun(false);
+            }
+        }
+
+        concatData.clear();
+        for (size_t i = 0; i < fileSources.size(); ++i) {
+            SourceState& state = states[i];
+            state.fileName = fileSources[i]->getFileName();
+            // The processed tail is read again so that its checksum can move along.
+            uint64_t readStart = state.offset - min(state.offset, incrementalTailBytes);
+            TRACE_SPAN("read", "read " + state.fileName + " from " + to_string(readStart));
+            StageProbe probe(profile);
+            if (!fileSources[i]->readFrom(readStart)) {
+                continue;
+            }
+            if (probe.isActive()) {
+                profile->record(probe.finish("read " + state.fileName + " from " + to_string(readStart),
+                                             fileSources[i]->getSize(), fileSources[i]->getSize()));
+            }
+            const char* bytes = fileSources[i]->getData();
+            size_t available = completeLinesLength(bytes, fileSources[i]->getSize());
+            size_t alreadyProcessed = state.offset - readStart;
+            if (available > alreadyProcessed) {
+                concatData.append(bytes + alreadyProcessed, available - alreadyProcessed);
+            }
+            size_t processed = max(available, alreadyProcessed);
+            size_t tail = static_cast<size_t>(min<uint64_t>(processed, incrementalTailBytes));
+            state.tailChecksum = hashBytes(bytes + processed - tail, tail);
+            state.offset = readStart + processed;
+            readMetadata(state.fileName, state.fileSize, state.modified);
+        }
+
+        if (incremental && concatData.getSize() == 0) {
+            saveIncrementalState(statePath, chainHash, states);
+            return true;
+        }
+        for (int i = 0; i < splitSafeStages; ++i) {
+            applyStage(concatData, transformations[i]);
+        }
+        if (global) {
+            applyStage(concatData, global);
+            if (incremental && !global->mergeIncremental(previousStage, concatData)) {
+                error_code error;
+                filesystem::remove(statePath, error);
+                return processIncremental(statePath);
+            }
+            writeWholeFile(stagePath, concatData);
+        }
+        outputSources();
+        saveIncrementalState(statePath, chainHash, states);
+        return incremental;
+    }
+
+    // Keeps the pipeline and its buffers alive and reruns it whenever one of the file sources
+    // changes, incrementally when statePath is given. Runs until SIGINT/SIGTERM, or until
+    // maxReruns reruns if that is not negative. Latency is measured from the newest
+    // modification time of the sources to the end of the output.
+    void watch(const char* statePath, WatchStats& stats, int maxReruns = -1) {
+        FileWatcher watcher;
+        for (int i = 0; i < numSources; ++i) {
+            if (auto* fileSource = dynamic_cast<TextFileSource*>(sources[i])) {
+                watcher.addFile(fileSource->getFileName());
+            }
+        }
+        stopRequested = 0;
+        signal(SIGINT, requestStop);
+        signal(SIGTERM, requestStop);
+
+        rerun(statePath);
+        while (!stopRequested && (maxReruns < 0 || static_cast<int>(stats.runs) < maxReruns)) {
+            if (!watcher.waitForChange(200)) {
+                continue;
+            }
+            bool incremental = rerun(statePath);
+            auto latency = filesystem::file_time_type::clock::now() - watcher.lastModified();
+            stats.record(chrono::duration<double, milli>(latency).count(), incremental);
+        }
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+    }
+
+    bool rerun(const char* statePath) {
+        if (statePath) {
+            return processIncremental(statePath);
+        }
+        processFully();
+        return false;
+    }
+
+    // Runs the whole pipeline, replacing what earlier runs wrote to the outputs.
+    void processFully() {
+        for (int i = 0; i < numOutputs; ++i) {
+            outputs[i]->beginRun(false);
+        }
+        for (PipelineBranch& branch : branches) {
+            for (TextOutput* output : branch.outputs) {
+                output->beginRun(false);
+            }
+        }
+        process();
+    }
+
+    // Adds a branch fed by the output of parent: 0 for the processor's own transforms, or
+    // the id returned by an earlier addBranch. The shared prefix is computed once per run.
+    int addBranch(int parent, TextTransform* branchTransformations[], int numBranchTransformations,
+                  TextOutput* branchOutputs[], int numBranchOutputs) {
+        if (parent < 0 || parent > static_cast<int>(branches.size())) {
+            cerr << "Invalid parent branch." << endl;
+            return -1;
+        }
+        PipelineBranch branch;
+        branch.transformations.assign(branchTransformations, branchTransformations + numBranchTransformations);
+        branch.outputs.assign(branchOutputs, branchOutputs + numBranchOutputs);
+        for (TextOutput* output : branch.outputs) {
+            output->setThreadPool(pool);
+        }
+        branches.push_back(branch);
+        int branchId = static_cast<int>(branches.size());
+        (parent == 0 ? rootBranches : branches[parent - 1].children).push_back(branchId);
+        return branchId;
+    }
+
+    // Also hands pool to every output, including those of branches added later.
+    void setThreadPool(WorkStealingPool* workStealingPool) {
+        pool = workStealingPool;
+        for (int i = 0; i < numOutputs; ++i) {
+            outputs[i]->setThreadPool(pool);
+        }
+        for (PipelineBranch& branch : branches) {
+            for (TextOutput* output : branch.outputs) {
+                output->setThreadPool(pool);
+            }
+        }
+    }
+
+    // Records every source read, transform apply and output write of later runs in stageProfile.
+    void setProfile(PipelineProfile* stageProfile) {
+        profile = stageProfile;
+    }
+
+    void setCache(ResultCache* resultCache, CacheKeyMode keyMode = CacheKeyMode::Content) {
+        cache = resultCache;
+        cacheKeyMode = keyMode;
+    }
+
+    // Limits the memory a run uses for its data. A pipeline whose input would not fit is
+    // streamed from its file sources in chunks, spilling to spillDir (default: the system
+    // temporary directory) where a result must be kept whole. 0 means no limit.
+    void setMemoryBudget(size_t bytes, const char* spillDir = nullptr) {
+        memoryBudget = bytes;
+        spillDirectory = spillDir ? spillDir : "";
+    }
+
+    const MemoryStats& getMemoryStats() const {
+        return memoryStats;
+    }
+
+    // With no transforms, also writes a manifest of where each source starts in the output.
+    void setManifest(const char* path) {
+        manifestPath = path ? path : "";
+    }
+
+    void process() {
+        concatData.clear();
+        sourceLengths.clear();
+        memoryStats = MemoryStats();
+        memoryStats.budget = memoryBudget;
+        if (memoryBudget > 0) {
+            resetPeakResident();
+        }
+        if (processArchive()) {
+            writeManifest();
+            if (memoryBudget > 0) {
+                memoryStats.peakResident = readPeakResident();
+            }
+            return;
+        }
+        if (exceedsMemoryBudget() && !cache && branches.empty()) {
+            if (processStreaming()) {
+                memoryStats.peakResident = readPeakResident();
+                return;
+            }
+            cerr << "The pipeline cannot stream; processing it in memory beyond the budget." << endl;
+            memoryStats = MemoryStats();
+            memoryStats.budget = memoryBudget;
+        }
+        if (cache) {
+            processCached();
+        } else {
+            readFromSources();
+            applyTransformations();
+        }
+        outputSources();
+        writeManifest();
+        runRootBranches();
+        memoryStats.peakBuffered = max(memoryStats.peakBuffered, concatData.getSize());
+        if (memoryBudget > 0) {
+            memoryStats.peakResident = readPeakResident();
+        }
+    }
+};
+
+static bool parseByteSize(const char* text, size_t& bytes) {
+    char* end;
+    double value = strtod(text, &end);
+    switch (toupper(static_cast<unsigned char>(*end))) {
+        case 'K': value *= 1024.0; end++; break;
+        case 'M': value *= 1024.0 * 1024.0; end++; break;
+        case 'G': value *= 1024.0 * 1024.0 * 1024.0; end++; break;
+        default: break;
+    }
+    if (end == text || *end != '\0' || value < 0) {
+        return false;
+    }
+    bytes = static_cast<size_t>(value);
+    return true;
+}
+
+// One job of a pipeline spec: the sources, transforms and outputs it owns plus how to run it.
+struct PipelineTask {
+    string name;
+    deque<string> arguments;
+    vector<unique_ptr<TextSource>> ownedSources;
+    vector<unique_ptr<TextTransform>> ownedTransforms;
+    vector<unique_ptr<TextOutput>> ownedOutputs;
+    vector<TextSource*> sources;
+    vector<TextTransform*> transformations;
+    vector<TextOutput*> outputs;
+    string cacheDirectory;
+    CacheKeyMode cacheKeyMode = CacheKeyMode::Content;
+    string statePath;
+    bool watch = false;
+    bool optimize = false;
+    bool profiled = false;
+    PipelineProfile profile;
+    size_t memoryBudget = 0;
+    string spillDirectory;
+    string manifestPath;
+    int priority = 0;
+    PipelineTask* parent = nullptr;
+    vector<PipelineTask*> children;
+
+    // Arguments must outlive the objects built from them, which keep plain pointers.
+    const char* keep(const string& argument) {
+        arguments.push_back(argument);
+        return arguments.back().c_str();
+    }
+
+    // Rough peak memory of a run: the file sources' sizes times the buffers alive at once.
+    size_t estimateMemory() const {
+        size_t inputBytes = 0;
+        for (TextSource* source : sources) {
+            if (auto* fileSource = dynamic_cast<TextFileSource*>(source)) {
+                inputBytes += fileSource->estimateSize();
+            }
+        }
+        size_t estimate = inputBytes * 4 + (1 << 20);
+        // A task with a memory budget streams instead of growing past it.
+        return memoryBudget > 0 ? min(estimate, memoryBudget + (1 << 20)) : estimate;
+    }
+
+    void addBranches(TextProcessor& processor, int branchId) {
+        for (PipelineTask* child : children) {
+            int childId = processor.addBranch(branchId, child->transformations.data(),
+                                              static_cast<int>(child->transformations.size()),
+                                              child->outputs.data(), static_cast<int>(child->outputs.size()));
+            child->addBranches(processor, childId);
+        }
+    }
+
+    void closeOutputs() {
+        outputs.clear();
+        ownedOutputs.clear();
+        for (PipelineTask* child : children) {
+            child->closeOutputs();
+        }
+    }
+
+    // Rewrites the transforms of this task and its branches, reporting each plan on out.
+    void optimizeTransforms(PipelineOptimizer& optimizer, ostream& out) {
+        out << "Task '" << name << "':\n";
+        optimizer.optimize(transformations).print(out);
+        for (PipelineTask* child : children) {
+            child->optimizeTransforms(optimizer, out);
+        }
+    }
+
+    // Runs the task together with the tasks that branch off it ('from' lines).
+    void run(WorkStealingPool* pool = nullptr) {
+        TRACE_SPAN("task", "task " + name);
+        // Transforms the optimizer creates live as long as the optimizer.
+        PipelineOptimizer optimizer;
+        if (optimize) {
+            optimizeTransforms(optimizer, cerr);
+            optimize = false;
+        }
+        TextProcessor processor(sources.data(), static_cast<int>(sources.size()),
+                                transformations.data(), static_cast<int>(transformations.size()),
+                                outputs.data(), static_cast<int>(outputs.size()));
+        processor.setThreadPool(pool);
+        processor.setProfile(profiled ? &profile : nullptr);
+        processor.setMemoryBudget(memoryBudget, spillDirectory.empty() ? nullptr : spillDirectory.c_str());
+        processor.setManifest(manifestPath.c_str());
+        addBranches(processor, 0);
+        unique_ptr<ResultCache> cache;
+        if (!cacheDirectory.empty()) {
+            cache = make_unique<ResultCache>(cacheDirectory.c_str());
+            processor.setCache(cache.get(), cacheKeyMode);
+        }
+        const char* state = statePath.empty() ? nullptr : statePath.c_str();
+        if (watch) {
+            WatchStats stats;
+            processor.watch(state, stats);
+            stats.print(cerr);
+        } else if (state) {
+            processor.processIncremental(state);
+        } else {
+            processor.process();
+        }
+        if (cache) {
+            cache->printStats(cerr);
+        }
+        if (profiled) {
+            cerr << "Task '" << name << "' profile:\n";
+            profile.print(cerr);
+        }
+        if (memoryBudget > 0) {
+            cerr << "Task '" << name << "' ";
+            processor.getMemoryStats().print(cerr);
+        }
+        // Closing the outputs completes their files for the tasks that follow.
+        closeOutputs();
+    }
+};
+
+// Line-based pipeline description. Each task lists its sources, transforms and outputs;
+// tasks run one after another, so a later task can read the files an earlier one wrote:
+//
+//   # Dictionary extraction, then split the dictionary into 1 KB files
+//   task dictionary
+//   source file ../data1.txt
+//   transform RemovePunctuation
+//   transform AddNewlineWord
+//   transform RemoveDuplicateLines
+//   output file 100000 ../dictionary
+//   end
+//   task split
+//   source file ../dictionary_000.txt
+//   output file 1000 ../dictionary_part
+//   end
+//
+// A task may start from the output of an earlier task instead of sources ('from NAME').
+// Such tasks run as branches of that task's pipeline, so the shared prefix is computed once:
+//
+//   task words
+//   source file ../data1.txt
+//   transform RemovePunctuation
+//   transform AddNewlineWord
+//   end
+//   task dictionary
+//   from words
+//   transform RemoveDuplicateLines
+//   output file 100000 ../dictionary
+//   end
+//
+// Arguments are separated by whitespace; double quotes group words and accept \" \\ \n \t.
+// Lines outside any task form an implicit task named "main".
+class PipelineSpec {
+    vector<unique_ptr<PipelineTask>> tasks;
+    string origin;
+    int lineNumber = 0;
+
+    bool fail(const string& message) const {
+        cerr << origin << ":" << lineNumber << ": " << message << endl;
+        return false;
+    }
+
+    static bool parseInt(const string& word, int& value) {
+        char* end;
+        long parsed = strtol(word.c_str(), &end, 10);
+        if (word.empty() || *end != '\0' || parsed < 0 || parsed > INT32_MAX) {
+            return false;
+        }
+        value = static_cast<int>(parsed);
+        return true;
+    }
+
+    bool addSource(PipelineTask& task, const vector<string>& words) {
+        const string& kind = words.size() > 1 ? words[1] : string();
+        if (kind == "file" && words.size() == 3) {
+            task.ownedSources.push_back(make_unique<TextFileSource>(task.keep(words[2])));
+        } else if (kind == "console" && words.size() == 2) {
+            task.ownedSources.push_back(make_unique<TextConsoleSource>());
+        } else if (kind == "index-query" && (words.size() == 4 || words.size() == 5)) {
+            bool matchAll = words.size() == 4 || words[4] == "and";
+            if (words.size() == 5 && words[4] != "and" && words[4] != "or") {
+                return fail("index-query mode must be 'and' or 'or'");
+            }
+            task.ownedSources.push_back(make_unique<IndexQuerySource>(task.keep(words[2]), task.keep(words[3]), matchAll));
+        } else if (kind == "archive" && (words.size() == 3 || words.size() == 4)) {
+            const char* member = (words.size() == 4) ? task.keep(words[3]) : nullptr;
+            task.ownedSources.push_back(make_unique<ArchiveMemberSource>(task.keep(words[2]), member));
+        } else {
+            return fail("expected 'source file PATH', 'source console', 'source index-query INDEX WORDS [and|or]' "
+                        "or 'source archive PATH [MEMBER]'");
+        }
+        task.sources.push_back(task.ownedSources.back().get());
+        return true;
+    }
+
+    bool addDistinctCounter(PipelineTask& task, const vector<string>& words, bool lines) {
+        DistinctMode mode = DistinctMode::Exact;
+        int precision = 14;
+        if (words.size() > 2) {
+            if (words[2] == "approximate") {
+                mode = DistinctMode::Approximate;
+            } else if (words[2] != "exact") {
+                return fail("distinct count mode must be 'exact' or 'approximate'");
+            }
+        }
+        if (words.size() > 3 && !parseInt(words[3], precision)) {
+            return fail("invalid precision '" + words[3] + "'");
+        }
+        if (lines) {
+            task.ownedTransforms.push_back(make_unique<CountDistinctLines>(mode, precision));
+        } else {
+            task.ownedTransforms.push_back(make_unique<CountDistinctWords>(mode, precision));
+        }
+        return true;
+    }
+
+    bool addSearch(PipelineTask& task, const vector<string>& words) {
+        SearchOptions options;
+        for (size_t i = 3; i < words.size(); ++i) {
+            if (words[i] == "-n") {
+                options.lineNumbers = true;
+            } else if (words[i] == "-b") {
+                options.byteOffsets = true;
+            } else if (words[i] == "-C" && i + 1 < words.size() && parseInt(words[i + 1], options.contextLines)) {
+                i++;
+            } else {
+                return fail("SearchLines options are -n, -b and -C N");
+            }
+        }
+        task.ownedTransforms.push_back(make_unique<SearchLines>(task.keep(words[2]), options));
+        return true;
+    }
+
+    bool addTransform(PipelineTask& task, const vector<string>& words) {
+        if (words.size() < 2) {
+            return fail("expected a transform name");
+        }
+        const string& name = words[1];
+        size_t numArgs = words.size() - 2;
+        auto expectArgs = [&](size_t expected) {
+            return numArgs == expected || fail(name + " takes " + to_string(expected) + " argument(s)");
+        };
+        int number = 0;
+
+        if (name == "RemoveString") {
+            if (!expectArgs(1)) return false;
+            task.ownedTransforms.push_back(make_unique<RemoveString>(task.keep(words[2])));
+        } else if (name == "RemoveLines") {
+            if (!expectArgs(1)) return false;
+            task.ownedTransforms.push_back(make_unique<RemoveLines>(task.keep(words[2])));
+        } else if (name == "FilterLines") {
+            if (numArgs < 1 || numArgs > 2 || (numArgs == 2 && words[3] != "keep" && words[3] != "drop")) {
+                return fail("expected 'FilterLines REGEX [keep|drop]'");
+            }
+            FilterMode mode = (numArgs == 2 && words[3] == "keep") ? FilterMode::Keep : FilterMode::Drop;
+            task.ownedTransforms.push_back(make_unique<FilterLines>(task.keep(words[2]), mode));
+        } else if (name == "SearchLines") {
+            if (numArgs < 1) {
+                return fail("expected 'SearchLines STRING [-n] [-b] [-C N]'");
+            }
+            if (!addSearch(task, words)) return false;
+        } else if (name == "RemoveCharacter") {
+            if (!expectArgs(1)) return false;
+            if (words[2].size() != 1) {
+                return fail("RemoveCharacter takes a single character");
+            }
+            task.ownedTransforms.push_back(make_unique<RemoveCharacter>(words[2][0]));
+        } else if (name == "ReplaceString") {
+            if (!expectArgs(2)) return false;
+            task.ownedTransforms.push_back(make_unique<ReplaceString>(task.keep(words[2]), task.keep(words[3])));
+        } else if (name == "AddNewlineMaxChars") {
+            if (!expectArgs(1)) return false;
+            if (!parseInt(words[2], number) || number == 0) {
+                return fail("invalid line length '" + words[2] + "'");
+            }
+            task.ownedTransforms.push_back(make_unique<AddNewlineMaxChars>(number));
+        } else if (name == "SortUnique") {
+            if (numArgs > 1 || (numArgs == 1 && words[2] != "count" && words[2] != "distinct")) {
+                return fail("expected 'SortUnique [distinct|count]'");
+            }
+            UniqueMode mode = (numArgs == 1 && words[2] == "count") ? UniqueMode::Count : UniqueMode::Distinct;
+            task.ownedTransforms.push_back(make_unique<SortUnique>(mode));
+        } else if (name == "CountDistinctLines" || name == "CountDistinctWords") {
+            if (numArgs > 2) {
+                return fail("expected '" + name + " [exact|approximate] [PRECISION]'");
+            }
+            if (!addDistinctCounter(task, words, name == "CountDistinctLines")) return false;
+        } else {
+            if (!expectArgs(0)) return false;
+            if (name == "RemovePunctuation") {
+                task.ownedTransforms.push_back(make_unique<RemovePunctuation>());
+            } else if (name == "AddNewlineSentence") {
+                task.ownedTransforms.push_back(make_unique<AddNewlineSentence>());
+            } else if (name == "AddNewlineWord") {
+                task.ownedTransforms.push_back(make_unique<AddNewlineWord>());
+            } else if (name == "RemoveNewline") {
+                task.ownedTransforms.push_back(make_unique<RemoveNewline>());
+            } else if (name == "LexSortLines") {
+                task.ownedTransforms.push_back(make_unique<LexSortLines>());
+            } else if (name == "RemoveDuplicateLines") {
+                task.ownedTransforms.push_back(make_unique<RemoveDuplicateLines>());
+            } else if (name == "CountLines") {
+                task.ownedTransforms.push_back(make_unique<CountLines>());
+            } else if (name == "CountSymbols") {
+                task.ownedTransforms.push_back(make_unique<CountSymbols>());
+            } else {
+                return fail("unknown transform '" + name + "'");
+            }
+        }
+        task.transformations.push_back(task.ownedTransforms.back().get());
+        return true;
+    }
+
+    // Recognizes "gzip"/"gz", optionally with a level as in "gzip:9", and "zstd"/"zst",
+    // failing for formats this build cannot write. Anything else is no compression.
+    bool parseCompression(const string& word, Compression& format, int& level) {
+        format = Compression::None;
+        level = 6;
+        size_t colon = word.find(':');
+        string name = word.substr(0, colon);
+        if (name == "zstd" || name == "zst") {
+            return fail("zstd output is not supported by this build");
+        }
+        if (name != "gzip" && name != "gz") {
+            return true;
+        }
+        if (!HW4_HAVE_ZLIB) {
+            return fail("gzip output needs a build with zlib");
+        }
+        if (colon != string::npos && (!parseInt(word.substr(colon + 1), level) || level < 1 || level > 9)) {
+            return fail("the gzip level must be 1-9, as in 'gzip:9'");
+        }
+        format = Compression::Gzip;
+        return true;
+    }
+
+    bool addOutput(PipelineTask& task, const vector<string>& words) {
+        const string& kind = words.size() > 1 ? words[1] : string();
+        int maxSizeK = 0;
+        if (kind == "console" && words.size() == 2) {
+            task.ownedOutputs.push_back(make_unique<TextConsoleOutput>());
+        } else if (kind == "file" && words.size() >= 3 && words.size() <= 5 && parseInt(words[2], maxSizeK) && maxSizeK > 0) {
+            size_t nameWords = words.size();
+            Compression format = Compression::None;
+            int level = 6;
+            if (nameWords > 3 && !parseCompression(words.back(), format, level)) {
+                return false;
+            }
+            nameWords -= (format != Compression::None) ? 1 : 0;
+            if (nameWords == 5) {
+                return fail("expected 'output file MAX_SIZE [BASENAME] [gzip[:LEVEL]]'");
+            }
+            const char* fileName = (nameWords == 4) ? task.keep(words[3]) : "../output";
+            auto output = make_unique<TextFileOutput>(maxSizeK, fileName);
+            output->setCompression(format, level);
+            task.ownedOutputs.push_back(move(output));
+        } else if (kind == "index" && words.size() == 3) {
+            task.ownedOutputs.push_back(make_unique<InvertedIndexOutput>(task.keep(words[2])));
+        } else if (kind == "archive" && words.size() == 3) {
+            task.ownedOutputs.push_back(make_unique<ArchiveOutput>(task.keep(words[2])));
+        } else if (kind == "split" && words.size() >= 5 && words.size() <= 7 && parseInt(words[2], maxSizeK) && maxSizeK > 0) {
+            SplitMode mode;
+            if (words[3] == "lines") {
+                mode = SplitMode::Lines;
+            } else if (words[3] == "words") {
+                mode = SplitMode::Words;
+            } else if (words[3] == "bytes") {
+                mode = SplitMode::Bytes;
+            } else {
+                return fail("split mode must be 'lines', 'words' or 'bytes'");
+            }
+            string shardPattern = (words.size() >= 6) ? words[5] : string("part_{}.txt");
+            if (shardPattern.find("{}") == string::npos) {
+                return fail("the shard name pattern needs a {} for the shard number");
+            }
+            // An explicit format word wins over the pattern's extension.
+            Compression format = Compression::None;
+            int level = 6;
+            size_t extension = shardPattern.rfind('.');
+            if (words.size() == 7) {
+                if (!parseCompression(words[6], format, level)) {
+                    return false;
+                }
+                if (format == Compression::None) {
+                    return fail("unknown compression '" + words[6] + "'");
+                }
+            } else if (extension != string::npos && !parseCompression(shardPattern.substr(extension + 1), format, level)) {
+                return false;
+            }
+            auto output = make_unique<TextFileOutput>(maxSizeK, "", mode);
+            output->setShardNames(task.keep(words[4]), task.keep(shardPattern));
+            output->setCompression(format, level);
+            task.ownedOutputs.push_back(move(output));
+        } else {
+            return fail("expected 'output console', 'output file MAX_SIZE [BASENAME] [gzip[:LEVEL]]', 'output index PATH', "
+                        "'output archive PATH' or 'output split MAX_SIZE lines|words|bytes DIR [PATTERN [gzip[:LEVEL]]]'");
+        }
+        task.outputs.push_back(task.ownedOutputs.back().get());
+        return true;
+    }
+
+    bool parseLine(const vector<string>& words, PipelineTask*& task) {
+        const string& keyword = words[0];
+        if (keyword == "task") {
+            if (words.size() != 2) {
+                return fail("expected 'task NAME'");
+            }
+            tasks.push_back(make_unique<PipelineTask>());
+            task = tasks.back().get();
+            task->name = words[1];
+            return true;
+        }
+        if (keyword == "end") {
+            if (!task || words.size() != 1) {
+                return fail("'end' without a task");
+            }
+            task = nullptr;
+            return true;
+        }
+        if (!task) {
+            tasks.push_back(make_unique<PipelineTask>());
+            task = tasks.back().get();
+            task->name = "main";
+        }
+        if (keyword == "source") {
+            return addSource(*task, words);
+        } else if (keyword == "transform") {
+            return addTransform(*task, words);
+        } else if (keyword == "output") {
+            return addOutput(*task, words);
+        } else if (keyword == "cache" && (words.size() == 2 || (words.size() == 3 && words[2] == "metadata"))) {
+            task->cacheDirectory = words[1];
+            task->cacheKeyMode = (words.size() == 3) ? CacheKeyMode::Metadata : CacheKeyMode::Content;
+            return true;
+        } else if (keyword == "incremental" && words.size() == 2) {
+            task->statePath = words[1];
+            return true;
+        } else if (keyword == "watch" && words.size() == 1) {
+            task->watch = true;
+            return true;
+        } else if (keyword == "optimize" && words.size() == 1) {
+            task->optimize = true;
+            return true;
+        } else if (keyword == "profile" && words.size() == 1) {
+            task->profiled = true;
+            return true;
+        } else if (keyword == "memory" && (words.size() == 2 || words.size() == 3)) {
+            if (!parseByteSize(words[1].c_str(), task->memoryBudget)) {
+                return fail("invalid memory budget '" + words[1] + "'");
+            }
+            task->spillDirectory = (words.size() == 3) ? words[2] : string();
+            return true;
+        } else if (keyword == "manifest" && words.size() == 2) {
+            task->manifestPath = words[1];
+            return true;
+        } else if (keyword == "from" && words.size() == 2) {
+            for (auto& earlier : tasks) {
+                if (earlier->name == words[1] && earlier.get() != task) {
+                    task->parent = earlier.get();
+                    earlier->children.push_back(task);
+                    return true;
+                }
+            }
+            return fail("unknown task '" + words[1] + "'");
+        } else if (keyword == "priority" && words.size() == 2) {
+            if (!parseInt(words[1], task->priority)) {
+                return fail("invalid priority '" + words[1] + "'");
+            }
+            return true;
+        }
+        return fail("unknown or malformed directive '" + keyword + "'");
+    }
+public:
+    static bool tokenize(const string& line, vector<string>& words) {
+        words.clear();
+        size_t i = 0;
+        while (i < line.size()) {
+            while (i < line.size() && isspace(static_cast<unsigned char>(line[i]))) {
+                i++;
+            }
+            if (i >= line.size() || line[i] == '#') {
+                break;
+            }
+            string word;
+            if (line[i] == '"') {
+                i++;
+                while (i < line.size() && line[i] != '"') {
+                    char c = line[i++];
+                    if (c == '\\' && i < line.size()) {
+                        c = line[i++];
+                        c = (c == 'n') ? '\n' : (c == 't') ? '\t' : c;
+                    }
+                    word.push_back(c);
+                }
+                if (i >= line.size()) {
+                    return false;
+                }
+                i++;
+            } else {
+                while (i < line.size() && !isspace(static_cast<unsigned char>(line[i]))) {
+                    word.push_back(line[i++]);
+                }
+            }
+            words.push_back(word);
+        }
+        return true;
+    }
+
+    bool parse(istream& input, const string& inputName) {
+        origin = inputName;
+        lineNumber = 0;
+        PipelineTask* task = nullptr;
+        string line;
+        vector<string> words;
+        while (getline(input, line)) {
+            lineNumber++;
+            if (!tokenize(line, words)) {
+                return fail("unterminated quote");
+            }
+            if (!words.empty() && !parseLine(words, task)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool parseFile(const char* fileName) {
+        ifstream input(fileName);
+        if (!input) {
+            cerr << "Failed to open the file." << endl;
+            return false;
+        }
+        return parse(input, fileName);
+    }
+
+    bool validate() const {
+        if (tasks.empty()) {
+            cerr << "The pipeline spec has no tasks." << endl;
+            return false;
+        }
+        for (const auto& task : tasks) {
+            if (task->parent && !task->sources.empty()) {
+                cerr << "Task '" << task->name << "' cannot have both sources and 'from'." << endl;
+                return false;
+            }
+            if (!task->parent && task->sources.empty()) {
+                cerr << "Task '" << task->name << "' needs at least one source or a 'from' line." << endl;
+                return false;
+            }
+            if (task->outputs.empty() && task->children.empty()) {
+                cerr << "Task '" << task->name << "' needs at least one output." << endl;
+                return false;
+            }
+            if (task->parent && (task->watch || !task->statePath.empty() || !task->cacheDirectory.empty())) {
+                cerr << "Task '" << task->name << "' runs as a branch; set watch, incremental and cache on its root task." << endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t getTaskCount() const {
+        return tasks.size();
+    }
+
+    PipelineTask& getTask(size_t index) {
+        return *tasks[index];
+    }
+
+    void run(WorkStealingPool* pool = nullptr) {
+        for (auto& task : tasks) {
+            if (!task->parent) {
+                task->run(pool);
+            }
+        }
+    }
+};
+
+// One edit as the journal stores it: at offset, the removed bytes were replaced by the
+// inserted bytes. The pointers stay valid until the journal records the next edit.
+struct EditDelta {
+    size_t offset;
+    const char* removed;
+    size_t removedLength;
+    const char* inserted;
+    size_t insertedLength;
+};
+
+// Undo/redo history as compact deltas: each edit is an offset plus the bytes it removed and
+// inserted, stored back to back in one buffer. Typing and deleting next to the previous edit
+// extend it instead of adding one, until seal() (e.g. on a cursor jump) or until the edit
+// reaches coalesceLimit bytes. When the history grows past its byte limit, the oldest edits
+// are forgotten. Undoing or redoing an edit is O(edit size), independent of the text size.
+class EditJournal {
+    struct Entry {
+        size_t offset;
+        size_t bytesStart;    // removed bytes, then inserted bytes; relative to bytesBase
+        size_t removedLength;
+        size_t insertedLength;
+    };
+
+    static constexpr size_t coalesceLimit = 4096;
+
+    size_t maxBytes;
+    deque<Entry> entries;
+    size_t current = 0;       // entries before it can be undone, from it redone
+    CustomVector bytes;
+    size_t bytesBase = 0;     // position of bytes[0] in the stream of all recorded bytes
+    bool sealed = true;
+    size_t forgottenEdits = 0;
+
+    size_t endOf(const Entry& entry) const {
+        return entry.bytesStart + entry.removedLength + entry.insertedLength;
+    }
+
+    void dropRedo() {
+        if (current == entries.size()) {
+            return;
+        }
+        entries.resize(current);
+        bytes.resize(entries.empty() ? 0 : endOf(entries.back()) - bytesBase);
+        sealed = true;
+    }
+
+    void forgetOldest() {
+        while (getMemoryUsage() > maxBytes && !entries.empty()) {
+            entries.pop_front();
+            current--;
+            forgottenEdits++;
+        }
+        size_t live = entries.empty() ? bytesBase + bytes.getSize() : entries.front().bytesStart;
+        // Moves the live bytes to the front once they fill less than half of the buffer.
+        if (live - bytesBase > bytes.getSize() / 2) {
+            CustomVector kept;
+            kept.append(bytes.getData() + (live - bytesBase), bytes.getSize() - (live - bytesBase));
+            bytes.swap(kept);
+            bytesBase = live;
+        }
+    }
+
+    // Extends the last edit if the new one continues it; see the class comment.
+    bool coalesce(size_t offset, const char* removed, size_t removedLength,
+                  const char* inserted, size_t insertedLength) {
+        if (sealed || current == 0 || current != entries.size()) {
+            return false;
+        }
+        Entry& last = entries.back();
+        if (last.removedLength + last.insertedLength + removedLength + insertedLength > coalesceLimit) {
+            return false;
+        }
+        if (removedLength == 0 && last.removedLength == 0 && offset == last.offset + last.insertedLength) {
+            bytes.append(inserted, insertedLength);
+            last.insertedLength += insertedLength;
+            return true;
+        }
+        if (insertedLength != 0 || last.insertedLength != 0) {
+            // Backspacing over text typed in this edit takes it back out of the edit.
+            if (insertedLength == 0 && last.removedLength == 0 && removedLength <= last.insertedLength &&
+                offset + removedLength == last.offset + last.insertedLength) {
+                last.insertedLength -= removedLength;
+                bytes.resize(bytes.getSize() - removedLength);
+                if (last.insertedLength == 0) {
+                    entries.pop_back();
+                    current--;
+                    sealed = true;
+                }
+                return true;
+            }
+            return false;
+        }
+        if (offset == last.offset) {
+            bytes.append(removed, removedLength);
+            last.removedLength += removedLength;
+            return true;
+        }
+        if (offset + removedLength == last.offset) {
+            string later(bytes.getData() + (last.bytesStart - bytesBase), last.removedLength);
+            bytes.resize(last.bytesStart - bytesBase);
+            bytes.append(removed, removedLength);
+            bytes.append(later.data(), later.size());
+            last.offset = offset;
+            last.removedLength += removedLength;
+            return true;
+        }
+        return false;
+    }
+
+    EditDelta deltaOf(const Entry& entry) const {
+        const char* removed = bytes.getData() + (entry.bytesStart - bytesBase);
+        return { entry.offset, removed, entry.removedLength, removed + entry.removedLength, entry.insertedLength };
+    }
+public:
+    explicit EditJournal(size_t maxBytes = 64 << 20) : maxBytes(maxBytes) {}
+
+    // Records an edit that has been applied to the text and drops the redo history.
+    void record(size_t offset, const char* removed, size_t removedLength, const char* inserted, size_t insertedLength) {
+        if (removedLength == 0 && insertedLength == 0) {
+            return;
+        }
+        dropRedo();
+        if (!coalesce(offset, removed, removedLength, inserted, insertedLength)) {
+            entries.push_back({ offset, bytesBase + bytes.getSize(), removedLength, insertedLength });
+            bytes.append(removed, removedLength);
+            bytes.append(inserted, insertedLength);
+            current++;
+            sealed = false;
+        }
+        forgetOldest();
+    }
+
+    // Makes the next edit start a new undo step.
+    void seal() {
+        sealed = true;
+    }
+
+    // The edit to revert: erase insertedLength bytes at offset and insert the removed bytes.
+    bool undo(EditDelta& delta) {
+        if (current == 0) {
+            return false;
+        }
+        delta = deltaOf(entries[--current]);
+        sealed = true;
+        return true;
+    }
+
+    // The edit to apply again: erase removedLength bytes at offset and insert the inserted bytes.
+    bool redo(EditDelta& delta) {
+        if (current == entries.size()) {
+            return false;
+        }
+        delta = deltaOf(entries[current++]);
+        sealed = true;
+        return true;
+    }
+
+    void setMaxBytes(size_t limit) {
+        maxBytes = limit;
+        forgetOldest();
+    }
+
+    void clear() {
+        entries.clear();
+        current = 0;
+        bytesBase += bytes.getSize();
+        bytes.clear();
+        sealed = true;
+    }
+
+    size_t getUndoCount() const {
+        return current;
+    }
+
+    size_t getRedoCount() const {
+        return entries.size() - current;
+    }
+
+    size_t getForgottenCount() const {
+        return forgottenEdits;
+    }
+
+    size_t getMemoryUsage() const {
+        return bytes.getSize() + entries.size() * sizeof(Entry);
+    }
+};
+
+// Editing engine for large files. The file is memory-mapped and edited through a piece
+// table with a line index, so opening costs one scan for newlines, jumping to a line is
+// O(log n) and an edit never moves the rest of the file. Saving writes only the edited
+// regions when every unedited byte is still at its original offset, and otherwise streams
+// the pieces to a new file that replaces the old one. Undo history is an EditJournal.
+class TextEditor {
+    string fileName;
+    unique_ptr<MappedFile> file;
+    unique_ptr<PieceTable> text;
+    size_t cursor = 0;
+    EditJournal journal;
+    bool modified = false;
+
+    string copyText(size_t offset, size_t length) const {
+        string bytes(length, '\0');
+        for (size_t i = 0; i < length; ++i) {
+            bytes[i] = text->at(offset + i);
+        }
+        return bytes;
+    }
+
+    void replace(size_t offset, size_t removedLength, const char* inserted, size_t insertedLength) {
+        text->erase(offset, removedLength);
+        text->insert(offset, inserted, insertedLength);
+        cursor = offset + insertedLength;
+        modified = modified || removedLength > 0 || insertedLength > 0;
+    }
+
+    bool reopen(const string& path) {
+        auto reopened = make_unique<MappedFile>();
+        if (!reopened->open(path.c_str())) {
+            return false;
+        }
+        auto table = make_unique<PieceTable>(reopened->getData(), reopened->getSize());
+        table->indexLines();
+        text = move(table);
+        file = move(reopened);
+        fileName = path;
+        cursor = min(cursor, text->getSize());
+        return true;
+    }
+
+    // Every piece taken from the file still sits at its offset in the file, so writing the
+    // other pieces in place (and truncating) turns the file into the text.
+    bool unmovedOriginal() const {
+        const char* base = file->getData();
+        size_t size = file->getSize();
+        size_t position = 0;
+        bool unmoved = true;
+        text->forEachPiece([&](const char* bytes, size_t length) {
+            uintptr_t address = reinterpret_cast<uintptr_t>(bytes);
+            uintptr_t begin = reinterpret_cast<uintptr_t>(base);
+            if (size > 0 && address >= begin && address < begin + size && bytes != base + position) {
+                unmoved = false;
+            }
+            position += length;
+        });
+        return unmoved;
+    }
+
+    bool saveInPlace(size_t& bytesWritten) {
+#ifdef HW4_HAVE_MMAP
+        int fd = ::open(fileName.c_str(), O_WRONLY);
+        if (fd < 0) {
+            return false;
+        }
+        const char* base = file->getData();
+        size_t position = 0;
+        bool written = true;
+        text->forEachPiece([&](const char* bytes, size_t length) {
+            if (bytes != base + position) {
+                size_t done = 0;
+                while (written && done < length) {
+                    ssize_t n = pwrite(fd, bytes + done, length - done, static_cast<off_t>(position + done));
+                    written = n > 0;
+                    done += written ? static_cast<size_t>(n) : 0;
+                }
+                bytesWritten += done;
+            }
+            position += length;
+        });
+        written = written && ftruncate(fd, static_cast<off_t>(text->getSize())) == 0;
+        written = ::close(fd) == 0 && written;
+        return written;
+#else
+        return false;
+#endif
+    }
+
+    bool saveCopy(const string& path, size_t& bytesWritten) {
+        string temporary = path + ".hw4-save";
+        {
+            ofstream outputFile(temporary, ios::binary | ios::trunc);
+            if (!outputFile) {
+                cerr << "Failed to open the file." << endl;
+                return false;
+            }
+            text->forEachPiece([&](const char* bytes, size_t length) {
+                outputFile.write(bytes, length);
+            });
+            if (!outputFile.flush()) {
+                return false;
+            }
         }
+        error_code error;
+        filesystem::rename(temporary, path, error);
+        if (error) {
+            filesystem::remove(temporary, error);
+            return false;
+        }
+        bytesWritten += text->getSize();
+        return reopen(path);
+    }
+public:
+    bool open(const char* path) {
+        journal.clear();
+        cursor = 0;
+        modified = false;
+        return reopen(path);
     }
 
-    void readFromSources() {
-        for (int i = 0; i < numSources; ++i) {
-            sources[i]->readData();
-            const char* data = sources[i]->getData();
-            if(data) {
-                concatenate(data);
+    size_t getSize() const {
+        return text->getSize();
+    }
+
+    size_t getLineCount() const {
+        return text->getLineCount();
+    }
+
+    size_t getCursor() const {
+        return cursor;
+    }
+
+    size_t getCursorLine() const {
+        return text->lineOf(cursor);
+    }
+
+    bool isModified() const {
+        return modified;
+    }
+
+    void moveTo(size_t offset) {
+        cursor = min(offset, text->getSize());
+        journal.seal();
+    }
+
+    // Moves the cursor to the start of a line (0-based); past the end, to the last line.
+    void gotoLine(size_t line) {
+        cursor = text->lineStart(min(line, text->getLineCount() - 1));
+        journal.seal();
+    }
+
+    const EditJournal& getJournal() const {
+        return journal;
+    }
+
+    void setHistoryLimit(size_t bytes) {
+        journal.setMaxBytes(bytes);
+    }
+
+    // The line without its newline.
+    string getLine(size_t line) const {
+        size_t start = text->lineStart(line);
+        size_t end = (line + 1 < text->getLineCount()) ? text->lineStart(line + 1) - 1 : text->getSize();
+        return copyText(start, end - start);
+    }
+
+    // Inserts before the cursor and moves the cursor past the inserted text.
+    void insert(const string& bytes) {
+        size_t offset = cursor;
+        replace(offset, 0, bytes.data(), bytes.size());
+        journal.record(offset, nullptr, 0, bytes.data(), bytes.size());
+    }
+
+    // Deletes up to length bytes after the cursor.
+    void erase(size_t length) {
+        length = min(length, text->getSize() - cursor);
+        string removed = copyText(cursor, length);
+        replace(cursor, length, nullptr, 0);
+        journal.record(cursor, removed.data(), removed.size(), nullptr, 0);
+    }
+
+    // Deletes up to length bytes before the cursor.
+    void backspace(size_t length) {
+        length = min(length, cursor);
+        string removed = copyText(cursor - length, length);
+        replace(cursor - length, length, nullptr, 0);
+        journal.record(cursor, removed.data(), removed.size(), nullptr, 0);
+    }
+
+    bool undo() {
+        EditDelta delta;
+        if (!journal.undo(delta)) {
+            return false;
+        }
+        replace(delta.offset, delta.insertedLength, delta.removed, delta.removedLength);
+        return true;
+    }
+
+    bool redo() {
+        EditDelta delta;
+        if (!journal.redo(delta)) {
+            return false;
+        }
+        replace(delta.offset, delta.removedLength, delta.inserted, delta.insertedLength);
+        return true;
+    }
+
+    // Saves to path, or to the open file when path is empty. Reports the bytes written.
+    bool save(const string& path, size_t& bytesWritten) {
+        bytesWritten = 0;
+        bool saved = (path.empty() || path == fileName) && unmovedOriginal()
+                         ? saveInPlace(bytesWritten) || saveCopy(fileName, bytesWritten)
+                         : saveCopy(path.empty() ? fileName : path, bytesWritten);
+        modified = modified && !saved;
+        return saved;
+    }
+
+    // Runs editing commands, one per line, as spec lines are tokenized:
+    //   goto LINE | move OFFSET | insert TEXT | delete COUNT | backspace COUNT | undo | redo
+    //   print [LINES] | info | history BYTES | save [PATH] | quit
+    // Lines are numbered from 1. Printed lines and reports go to out.
+    bool runScript(istream& input, ostream& out) {
+        auto parseCount = [](const string& word, size_t& value) {
+            if (word.empty() || !all_of(word.begin(), word.end(), [](char c) { return isdigit(static_cast<unsigned char>(c)); })) {
+                return false;
+            }
+            errno = 0;
+            unsigned long long parsed = strtoull(word.c_str(), nullptr, 10);
+            value = static_cast<size_t>(parsed);
+            return errno == 0;
+        };
+        string line;
+        vector<string> words;
+        size_t lineNumber = 0;
+        while (getline(input, line)) {
+            lineNumber++;
+            if (!PipelineSpec::tokenize(line, words)) {
+                cerr << "editor:" << lineNumber << ": unterminated quote" << endl;
+                return false;
+            }
+            if (words.empty()) {
+                continue;
+            }
+            const string& command = words[0];
+            size_t count = 0;
+            bool hasCount = words.size() == 2 && parseCount(words[1], count);
+            if (command == "goto" && hasCount && count > 0) {
+                gotoLine(count - 1);
+            } else if (command == "move" && hasCount) {
+                moveTo(count);
+            } else if (command == "insert" && words.size() == 2) {
+                insert(words[1]);
+            } else if (command == "delete" && hasCount) {
+                erase(count);
+            } else if (command == "backspace" && hasCount) {
+                backspace(count);
+            } else if (command == "history" && words.size() == 2 && parseByteSize(words[1].c_str(), count)) {
+                setHistoryLimit(count);
+            } else if (command == "undo" && words.size() == 1) {
+                undo();
+            } else if (command == "redo" && words.size() == 1) {
+                redo();
+            } else if (command == "print" && (words.size() == 1 || hasCount)) {
+                size_t first = getCursorLine();
+                size_t last = min(getLineCount(), first + (hasCount ? count : 1));
+                for (size_t i = first; i < last; ++i) {
+                    out << (i + 1) << ": " << getLine(i) << '\n';
+                }
+            } else if (command == "info" && words.size() == 1) {
+                out << fileName << ": " << getSize() << " bytes, " << getLineCount() << " lines, cursor at "
+                    << cursor << " (line " << (getCursorLine() + 1) << ")" << (modified ? ", modified" : "")
+                    << "; history " << journal.getUndoCount() << " undo, " << journal.getRedoCount() << " redo, "
+                    << journal.getMemoryUsage() << " bytes\n";
+            } else if (command == "save" && words.size() <= 2) {
+                size_t bytesWritten = 0;
+                if (!save(words.size() == 2 ? words[1] : string(), bytesWritten)) {
+                    cerr << "editor:" << lineNumber << ": cannot save " << fileName << endl;
+                    return false;
+                }
+                out << "saved " << fileName << ", " << bytesWritten << " bytes written\n";
+            } else if (command == "quit" && words.size() == 1) {
+                break;
+            } else {
+                cerr << "editor:" << lineNumber << ": unknown or malformed command '" << command << "'" << endl;
+                return false;
             }
         }
+        out.flush();
+        return true;
     }
+};
 
-    void applyTransformations() {
-        for (int i = 0; i < numTransformations; ++i) {
-                transformations[i]->apply(concatData);
+// Runs independent tasks concurrently on a shared pool, highest priority first. Each task
+// reserves its estimated memory from a global budget before it starts and waits while the
+// budget is exhausted; a task larger than the whole budget runs alone.
+class BatchRunner {
+    WorkStealingPool& pool;
+    size_t memoryBudget;
+    size_t memoryInUse;
+    mutex budgetLock;
+    condition_variable budgetFreed;
+
+    size_t acquire(size_t estimate) {
+        size_t reservation = (memoryBudget > 0) ? min(estimate, memoryBudget) : 0;
+        unique_lock<mutex> guard(budgetLock);
+        budgetFreed.wait(guard, [&] {
+            return memoryInUse + reservation <= memoryBudget || memoryBudget == 0;
+        });
+        memoryInUse += reservation;
+        return reservation;
+    }
+
+    void release(size_t reservation) {
+        {
+            lock_guard<mutex> guard(budgetLock);
+            memoryInUse -= reservation;
         }
+        budgetFreed.notify_all();
     }
+public:
+    explicit BatchRunner(WorkStealingPool& pool, size_t memoryBudget = 0)
+            : pool(pool), memoryBudget(memoryBudget), memoryInUse(0) {}
 
-    void outputSources() {
-        for (int i = 0; i < numOutputs; ++i) {
-            outputs[i]->writeData(concatData);
+    void run(vector<PipelineTask*> tasks) {
+        stable_sort(tasks.begin(), tasks.end(), [](const PipelineTask* a, const PipelineTask* b) {
+            return a->priority > b->priority;
+        });
+        auto start = chrono::steady_clock::now();
+        {
+            TaskGroup group(pool);
+            for (PipelineTask* task : tasks) {
+                size_t reservation = acquire(task->estimateMemory());
+                group.run([this, task, reservation] {
+                    task->run(&pool);
+                    release(reservation);
+                });
+            }
         }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cerr << "batch: " << tasks.size() << " tasks in " << seconds << " s on "
+             << pool.getThreadCount() << " threads" << endl;
     }
+};
 
-    void process() {
-        readFromSources();
-        applyTransformations();
-        outputSources();
+static void printUsage(const char* program) {
+    cerr << "Usage: " << program << " [--spec FILE]... [--source SPEC]... [--transform SPEC]... [--output SPEC]...\n"
+         << "       [--cache DIR] [--incremental STATE] [--watch] [--priority N]\n"
+         << "       [--jobs N] [--batch] [--memory-budget SIZE] [--optimize] [--profile] [--profile-json FILE]\n"
+         << "       [--counters] [--trace FILE] [--spill-dir DIR] [--manifest FILE]\n"
+         << "       " << program << " --edit FILE < SCRIPT\n\n"
+         << "--spec reads tasks from a pipeline spec file. The other options describe one more task\n"
+         << "using the same words as a spec line, e.g.\n"
+         << "  " << program << " --source \"file ../data1.txt\" --transform \"RemoveString warlock\" --output console\n"
+         << "--jobs runs parallel-safe stages on N threads. --batch runs all tasks concurrently,\n"
+         << "highest priority first, within --memory-budget (e.g. 512M, 4G). A task whose input\n"
+         << "does not fit its budget streams in chunks, spilling to --spill-dir if needed.\n"
+         << "--optimize reorders and drops transforms where the output stays the same and\n"
+         << "prints the rewritten plans.\n"
+         << "--profile prints the time, bytes and allocations of every read, apply and write;\n"
+         << "--profile-json writes them to FILE. --counters adds IPC and cache and branch misses\n"
+         << "per byte from hardware counters (Linux perf_event_open).\n"
+         << "--trace writes a Chrome trace-event file (chrome://tracing, Perfetto).\n"
+         << "Without transforms, file sources are copied to file and console outputs by the kernel;\n"
+         << "--manifest writes the offset, length and name of each source in the output to FILE.\n"
+         << "--edit opens FILE in the editor and runs the commands read from standard input\n"
+         << "(goto LINE, move OFFSET, insert TEXT, delete COUNT, backspace COUNT, undo, redo,\n"
+         << "print [LINES], info, history BYTES, save [PATH], quit).\n"
+         << "Without arguments the built-in demo pipeline runs." << endl;
+}
+
+static int runCommandLine(int argc, char* argv[]) {
+    PipelineSpec spec;
+    string commandLineTask;
+    size_t numThreads = 0;
+    size_t memoryBudget = 0;
+    bool batch = false;
+    bool optimize = false;
+    bool profiled = false;
+    bool hardwareCounters = false;
+    string profileJsonPath;
+    const char* tracePath = nullptr;
+    string spillDirectory;
+    TraceRecorder trace;
+    for (int i = 1; i < argc; ++i) {
+        string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (option == "--help" || option == "-h") {
+            printUsage(argv[0]);
+            return 0;
+        } else if (option == "--edit" && hasValue) {
+            TextEditor editor;
+            if (!editor.open(argv[++i])) {
+                return 1;
+            }
+            return editor.runScript(cin, cout) ? 0 : 1;
+        } else if (option == "--spec" && hasValue) {
+            if (!spec.parseFile(argv[++i])) {
+                return 1;
+            }
+        } else if ((option == "--source" || option == "--transform" || option == "--output" ||
+                    option == "--cache" || option == "--incremental" || option == "--priority" ||
+                    option == "--manifest") && hasValue) {
+            commandLineTask += option.substr(2) + " " + argv[++i] + "\n";
+        } else if (option == "--watch") {
+            commandLineTask += "watch\n";
+        } else if (option == "--optimize") {
+            optimize = true;
+        } else if (option == "--trace" && hasValue) {
+            tracePath = argv[++i];
+        } else if (option == "--profile") {
+            profiled = true;
+        } else if (option == "--counters") {
+            hardwareCounters = true;
+        } else if (option == "--profile-json" && hasValue) {
+            profileJsonPath = argv[++i];
+        } else if (option == "--jobs" && hasValue && atoi(argv[i + 1]) > 0) {
+            numThreads = atoi(argv[++i]);
+        } else if (option == "--memory-budget" && hasValue && parseByteSize(argv[i + 1], memoryBudget)) {
+            i++;
+        } else if (option == "--spill-dir" && hasValue) {
+            spillDirectory = argv[++i];
+        } else if (option == "--batch") {
+            batch = true;
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (!commandLineTask.empty()) {
+        istringstream input("task command-line\n" + commandLineTask + "end\n");
+        if (!spec.parse(input, "command line")) {
+            return 1;
+        }
+    }
+    if (!spec.validate()) {
+        return 1;
+    }
+    for (size_t i = 0; i < spec.getTaskCount(); ++i) {
+        spec.getTask(i).optimize |= optimize;
+        spec.getTask(i).profiled |= profiled || hardwareCounters || !profileJsonPath.empty();
+        spec.getTask(i).profile.setHardwareCounters(hardwareCounters);
+        // A spec's own 'memory' line takes precedence over the global budget, and its spill
+        // directory over --spill-dir.
+        if (spec.getTask(i).memoryBudget == 0) {
+            spec.getTask(i).memoryBudget = memoryBudget;
+        }
+        if (spec.getTask(i).spillDirectory.empty()) {
+            spec.getTask(i).spillDirectory = spillDirectory;
+        }
+    }
+    HardwareCounters::Sample counterCheck;
+    if (hardwareCounters && !HardwareCounters::read(counterCheck)) {
+        cerr << "Hardware counters are not available here; profiling without them." << endl;
+    }
+    if (tracePath) {
+        if (!HW4_TRACING) {
+            cerr << "Built without tracing (HW4_TRACING=0); " << tracePath << " will have no spans." << endl;
+        }
+        trace.start();
+    }
+    if (!batch && numThreads == 0) {
+        spec.run();
+    } else {
+        WorkStealingPool pool(numThreads > 0 ? numThreads : thread::hardware_concurrency());
+        if (batch) {
+            vector<PipelineTask*> tasks;
+            for (size_t i = 0; i < spec.getTaskCount(); ++i) {
+                if (!spec.getTask(i).parent) {
+                    tasks.push_back(&spec.getTask(i));
+                }
+            }
+            BatchRunner(pool, memoryBudget).run(tasks);
+        } else {
+            spec.run(&pool);
+        }
+    }
+    trace.stop();
+    if (tracePath && !trace.writeJson(tracePath)) {
+        cerr << "Cannot write " << tracePath << endl;
+        return 1;
+    }
+    if (!profileJsonPath.empty()) {
+        ofstream json(profileJsonPath);
+        json << '{';
+        const char* separator = "\n";
+        for (size_t i = 0; i < spec.getTaskCount(); ++i) {
+            const PipelineTask& task = spec.getTask(i);
+            if (task.parent) {
+                continue;
+            }
+            json << separator;
+            separator = ",\n";
+            writeJsonString(json, task.name);
+            json << ": ";
+            task.profile.writeJson(json);
+        }
+        json << "\n}" << endl;
+        if (!json) {
+            cerr << "Cannot write " << profileJsonPath << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#if HW4_BENCHMARK
+// Benchmark suite, built as the separate hw4_bench target: every transform, TextFileSource
+// and TextFileOutput on generated corpora from 1 KB up to 10 GB.
+
+struct CorpusOptions {
+    size_t lineLength = 60;         // mean line length; lines vary from half to 1.5 times it
+    size_t vocabulary = 5000;       // distinct words, drawn with a skew towards the first ones
+    double punctuationRate = 0.08;  // chance of a punctuation mark after a word
+    uint64_t seed = 1;
+
+    // Identifies the input profile in benchmark results and baselines.
+    string describe() const {
+        char description[128];
+        snprintf(description, sizeof(description), "line_length=%zu vocabulary=%zu punctuation=%g seed=%llu",
+                 lineLength, vocabulary, punctuationRate, static_cast<unsigned long long>(seed));
+        return description;
+    }
+};
+
+// Deterministic text generator: the same options always give the same bytes, so results are
+// comparable across runs and machines.
+class CorpusGenerator {
+    CorpusOptions options;
+    vector<string> words;
+    uint64_t state;
+
+    uint64_t next() {
+        state += 0x9e3779b97f4a7c15ULL;
+        return mixHash(state);
+    }
+
+    double nextUnit() {
+        return static_cast<double>(next() >> 11) / static_cast<double>(1ULL << 53);
+    }
+public:
+    explicit CorpusGenerator(const CorpusOptions& options) : options(options), state(options.seed) {
+        size_t vocabulary = max<size_t>(options.vocabulary, 1);
+        for (size_t i = 0; i < vocabulary; ++i) {
+            uint64_t h = mixHash(options.seed * 0x100000001b3ULL + i);
+            string word(1 + h % 9, 'a');
+            for (char& c : word) {
+                h = mixHash(h);
+                c = static_cast<char>('a' + h % 26);
+            }
+            words.push_back(word);
+        }
+    }
+
+    // Appends whole lines until out has grown by at least bytes.
+    void appendLines(CustomVector& out, size_t bytes) {
+        static const char punctuation[] = ",.;:!?";
+        size_t target = out.getSize() + bytes;
+        size_t meanLength = max<size_t>(options.lineLength, 2);
+        string line;
+        while (out.getSize() < target) {
+            size_t lineLength = meanLength / 2 + next() % (meanLength + 1);
+            line.clear();
+            while (line.size() < lineLength) {
+                if (!line.empty()) {
+                    line += ' ';
+                }
+                double u = nextUnit();
+                line += words[static_cast<size_t>(u * u * words.size())];
+                if (nextUnit() < options.punctuationRate) {
+                    line += punctuation[next() % (sizeof(punctuation) - 1)];
+                }
+            }
+            line += '\n';
+            out.append(line.data(), line.size());
+        }
+    }
+
+    // Exactly bytes of text, ending in a newline.
+    void generate(CustomVector& out, size_t bytes) {
+        out.clear();
+        out.reserve(bytes + 2 * options.lineLength + 64);
+        appendLines(out, bytes);
+        out.resize(bytes);
+        if (bytes > 0) {
+            out[bytes - 1] = '\n';
+        }
+    }
+};
+
+static double median(vector<double> values) {
+    if (values.empty()) {
+        return 0;
+    }
+    sort(values.begin(), values.end());
+    size_t middle = values.size() / 2;
+    return values.size() % 2 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+}
+
+struct BenchmarkResult {
+    string name;
+    string profile;
+    size_t bytes = 0;
+    size_t operations = 0;      // when set, the rate is in operations rather than bytes
+    vector<double> seconds;
+    size_t peakResident = 0;
+
+    double medianSeconds() const {
+        return median(seconds);
+    }
+
+    // "1.234GB/s" for byte throughput, "1.234M/s" for operations.
+    string formatRate(double medianSeconds) const {
+        char rate[32];
+        if (operations > 0) {
+            snprintf(rate, sizeof(rate), "%.3fM/s", operations / medianSeconds / 1e6);
+        } else {
+            snprintf(rate, sizeof(rate), "%.3fGB/s", bytes / medianSeconds / 1e9);
+        }
+        return rate;
+    }
+
+    // ns per byte, or per operation.
+    double nanosecondsPerUnit(double medianSeconds) const {
+        return medianSeconds * 1e9 / max<size_t>(operations > 0 ? operations : bytes, 1);
+    }
+
+    // Median absolute deviation of the repetitions: a spread estimate that ignores outliers.
+    double madSeconds() const {
+        double center = medianSeconds();
+        vector<double> deviations;
+        for (double value : seconds) {
+            deviations.push_back(fabs(value - center));
+        }
+        return median(deviations);
+    }
+
+    bool sameBenchmark(const BenchmarkResult& other) const {
+        return name == other.name && profile == other.profile && bytes == other.bytes;
+    }
+};
+
+// One benchmarked component. run() times one repetition on the given corpus, excluding setup.
+struct BenchmarkCase {
+    string name;
+    size_t maxLines;    // the legacy fixed-size transforms handle at most this many lines
+    size_t maxBytes;    // quadratic transforms are skipped above this
+    function<double(const CustomVector& corpus, const string& workDirectory)> run;
+    size_t onlyBytes = 0;       // if set, the case runs at this corpus size only
+    size_t operations = 0;      // if set, results are reported per operation, not per byte
+};
+
+static double timeSeconds(const function<void()>& work) {
+    auto start = chrono::steady_clock::now();
+    work();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+class BenchmarkSuite {
+    static constexpr double minRepetitionSeconds = 0.02;
+    static constexpr size_t editorCorpusBytes = size_t(1) << 30;
+
+    vector<unique_ptr<TextTransform>> transforms;
+    vector<BenchmarkCase> cases;
+
+    void addTransform(unique_ptr<TextTransform> transform, size_t maxLines = SIZE_MAX, size_t maxBytes = SIZE_MAX) {
+        TextTransform* raw = transform.get();
+        transforms.push_back(move(transform));
+        cases.push_back({ "transform " + transformLabel(raw), maxLines, maxBytes,
+                          [raw](const CustomVector& corpus, const string&) {
+                              CustomVector data = corpus;
+                              return timeSeconds([&] { raw->apply(data); });
+                          } });
+    }
+
+    // Replays edits as someone typing would make them: jump to a random line, type a few
+    // characters, backspace over some and delete a few ahead. Then undoes and redoes them all.
+    static double replayEdits(TextEditor& editor, size_t edits, uint64_t seed) {
+        return timeSeconds([&] {
+            uint64_t state = seed;
+            auto next = [&](uint64_t bound) {
+                state += 0x9e3779b97f4a7c15ULL;
+                return mixHash(state) % bound;
+            };
+            size_t done = 0;
+            while (done < edits) {
+                editor.gotoLine(next(editor.getLineCount()));
+                for (uint64_t typed = 1 + next(8); typed > 0 && done < edits; --typed, ++done) {
+                    editor.insert(string(1, static_cast<char>('a' + next(26))));
+                }
+                if (done < edits && next(2) == 0) {
+                    editor.backspace(1 + next(2));
+                    done++;
+                }
+                if (done < edits && next(4) == 0) {
+                    editor.erase(1 + next(3));
+                    done++;
+                }
+            }
+            while (editor.undo()) {
+            }
+            while (editor.redo()) {
+            }
+        });
+    }
+public:
+    explicit BenchmarkSuite(size_t editorEdits = 1000000) {
+        const size_t legacyLines = 1000;
+        const size_t quadraticBytes = 1 << 20;
+        addTransform(make_unique<RemoveString>("the"));
+        // The same literal as a plain substring search and as a regex, then real patterns.
+        addTransform(make_unique<RemoveLines>("ab"));
+        addTransform(make_unique<FilterLines>("ab"));
+        addTransform(make_unique<FilterLines>("^[a-m].*[.!?]$"));
+        addTransform(make_unique<FilterLines>("^[a-z]+ (ab|cd)", FilterMode::Keep));
+        addTransform(make_unique<SearchLines>("ab"));
+        SearchOptions context;
+        context.lineNumbers = true;
+        context.contextLines = 1;
+        addTransform(make_unique<SearchLines>("ab", context));
+        addTransform(make_unique<RemoveCharacter>('e'));
+        addTransform(make_unique<ReplaceString>("ab", "xyz"));
+        addTransform(make_unique<RemovePunctuation>());
+        addTransform(make_unique<AddNewlineSentence>());
+        addTransform(make_unique<AddNewlineWord>());
+        addTransform(make_unique<AddNewlineMaxChars>(40), SIZE_MAX, quadraticBytes);
+        addTransform(make_unique<RemoveNewline>());
+        addTransform(make_unique<LexSortLines>(), legacyLines);
+        addTransform(make_unique<RemoveDuplicateLines>(), SIZE_MAX, quadraticBytes);
+        addTransform(make_unique<SortUnique>());
+        addTransform(make_unique<SortUnique>(UniqueMode::Count));
+        addTransform(make_unique<CountLines>());
+        addTransform(make_unique<CountSymbols>());
+        addTransform(make_unique<CountDistinctLines>());
+        addTransform(make_unique<CountDistinctWords>());
+        addTransform(make_unique<CountDistinctWords>(DistinctMode::Approximate));
+
+        cases.push_back({ "source TextFileSource", SIZE_MAX, SIZE_MAX,
+                          [](const CustomVector& corpus, const string& workDirectory) {
+                              string path = workDirectory + "/source.txt";
+                              {
+                                  ofstream file(path, ios::binary);
+                                  file.write(corpus.getData(), corpus.getSize());
+                              }
+                              TextFileSource source(path.c_str());
+                              double seconds = timeSeconds([&] { source.readData(); });
+                              filesystem::remove(path);
+                              return seconds;
+                          } });
+        cases.push_back({ "output TextFileOutput", SIZE_MAX, SIZE_MAX,
+                          [](const CustomVector& corpus, const string& workDirectory) {
+                              string base = workDirectory + "/output";
+                              double seconds;
+                              {
+                                  TextFileOutput output(INT_MAX, base.c_str());
+                                  seconds = timeSeconds([&] {
+                                      output.writeData(corpus);
+                                      output.beginRun(false);
+                                  });
+                              }
+                              filesystem::remove(base + "_000.txt");
+                              return seconds;
+                          } });
+        // Edits per second on a 1 GB file; the corpus size only matters for where the edits land.
+        cases.push_back({ "editor replay " + to_string(editorEdits) + " edits, undo and redo", SIZE_MAX, SIZE_MAX,
+                          [editorEdits](const CustomVector& corpus, const string& workDirectory) {
+                              string path = workDirectory + "/editor.txt";
+                              {
+                                  ofstream file(path, ios::binary);
+                                  file.write(corpus.getData(), corpus.getSize());
+                              }
+                              double seconds;
+                              {
+                                  TextEditor editor;
+                                  editor.open(path.c_str());
+                                  seconds = replayEdits(editor, editorEdits, corpus.getSize());
+                              }
+                              filesystem::remove(path);
+                              return seconds;
+                          }, editorCorpusBytes, editorEdits });
+    }
+
+    // Runs every case whose name contains filter at every size, repetitions times each.
+    vector<BenchmarkResult> run(const vector<size_t>& sizes, const CorpusOptions& options, int repetitions,
+                                const string& filter, ostream& log) {
+        vector<BenchmarkResult> results;
+        string workDirectory = (filesystem::temp_directory_path() /
+                                ("hw4_bench_" + to_string(chrono::steady_clock::now().time_since_epoch().count()))).string();
+        filesystem::create_directories(workDirectory);
+
+        char row[160];
+        snprintf(row, sizeof(row), "%-48s %12s %10s %10s %12s", "benchmark", "bytes", "rate", "ns/unit", "peak RSS MB");
+        log << row << endl;
+        for (size_t bytes : sizes) {
+            CustomVector corpus;
+            CorpusGenerator(options).generate(corpus, bytes);
+            size_t lines = count(corpus.getData(), corpus.getData() + corpus.getSize(), '\n');
+            for (const BenchmarkCase& benchmark : cases) {
+                if (benchmark.name.find(filter) == string::npos) {
+                    continue;
+                }
+                if (benchmark.onlyBytes > 0 && bytes != benchmark.onlyBytes) {
+                    continue;
+                }
+                if (lines > benchmark.maxLines || bytes > benchmark.maxBytes) {
+                    snprintf(row, sizeof(row), "%-48s %12zu %10s", benchmark.name.c_str(), bytes, "skipped");
+                    log << row << endl;
+                    continue;
+                }
+                BenchmarkResult result;
+                result.name = benchmark.name;
+                result.profile = options.describe();
+                result.bytes = bytes;
+                result.operations = benchmark.operations;
+                resetPeakResident();
+                // Short cases repeat within a repetition until it lasts long enough to time.
+                for (int i = 0; i < repetitions; ++i) {
+                    double total = 0;
+                    int iterations = 0;
+                    do {
+                        total += benchmark.run(corpus, workDirectory);
+                        iterations++;
+                    } while (total < minRepetitionSeconds);
+                    result.seconds.push_back(total / iterations);
+                }
+                result.peakResident = readPeakResident();
+                double seconds = max(result.medianSeconds(), 1e-9);
+                snprintf(row, sizeof(row), "%-48s %12zu %10s %10.3f %12.1f", result.name.c_str(), bytes,
+                         result.formatRate(seconds).c_str(), result.nanosecondsPerUnit(seconds),
+                         result.peakResident / 1048576.0);
+                log << row << endl;
+                results.push_back(move(result));
+            }
+        }
+        error_code error;
+        filesystem::remove_all(workDirectory, error);
+        return results;
+    }
+};
+
+static void writeBenchmarkJson(ostream& out, const vector<BenchmarkResult>& results) {
+    out << "{\"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchmarkResult& result = results[i];
+        double seconds = max(result.medianSeconds(), 1e-9);
+        out << (i ? ",\n  " : "\n  ") << "{\"name\": ";
+        writeJsonString(out, result.name);
+        out << ", \"profile\": ";
+        writeJsonString(out, result.profile);
+        out << ", \"bytes\": " << result.bytes << ", \"seconds\": [";
+        for (size_t j = 0; j < result.seconds.size(); ++j) {
+            out << (j ? ", " : "") << result.seconds[j];
+        }
+        out << "], \"median_seconds\": " << result.medianSeconds() << ", \"mad_seconds\": " << result.madSeconds();
+        if (result.operations > 0) {
+            out << ", \"operations\": " << result.operations
+                << ", \"operations_per_s\": " << result.operations / seconds
+                << ", \"ns_per_operation\": " << result.nanosecondsPerUnit(seconds);
+        } else {
+            out << ", \"gb_per_s\": " << result.bytes / seconds / 1e9
+                << ", \"ns_per_byte\": " << result.nanosecondsPerUnit(seconds);
+        }
+        out << ", \"peak_resident\": " << result.peakResident << '}';
+    }
+    out << "\n]}" << endl;
+}
+
+// Minimal JSON reader for baseline files: objects, arrays, strings, numbers, true/false/null.
+class JsonValue {
+public:
+    enum class Type {
+        Null,
+        Boolean,
+        Number,
+        String,
+        Array,
+        Object
+    };
+
+    Type type = Type::Null;
+    double number = 0;
+    string text;
+    vector<JsonValue> items;
+    vector<pair<string, JsonValue>> members;
+
+    const JsonValue* find(const string& key) const {
+        for (const auto& member : members) {
+            if (member.first == key) {
+                return &member.second;
+            }
+        }
+        return nullptr;
+    }
+
+    static bool parse(const string& input, JsonValue& value) {
+        size_t pos = 0;
+        return parseValue(input, pos, value) && (skipSpace(input, pos), pos == input.size());
+    }
+private:
+    static void skipSpace(const string& input, size_t& pos) {
+        while (pos < input.size() && isspace(static_cast<unsigned char>(input[pos]))) {
+            pos++;
+        }
+    }
+
+    static bool parseString(const string& input, size_t& pos, string& text) {
+        if (pos >= input.size() || input[pos] != '"') {
+            return false;
+        }
+        pos++;
+        text.clear();
+        while (pos < input.size() && input[pos] != '"') {
+            char c = input[pos++];
+            if (c == '\\') {
+                if (pos >= input.size()) {
+                    return false;
+                }
+                char escaped = input[pos++];
+                switch (escaped) {
+                    case 'n': c = '\n'; break;
+                    case 't': c = '\t'; break;
+                    case 'r': c = '\r'; break;
+                    case 'b': c = '\b'; break;
+                    case 'f': c = '\f'; break;
+                    case 'u':
+                        if (pos + 4 > input.size()) {
+                            return false;
+                        }
+                        c = static_cast<char>(strtol(input.substr(pos, 4).c_str(), nullptr, 16));
+                        pos += 4;
+                        break;
+                    default: c = escaped; break;
+                }
+            }
+            text += c;
+        }
+        return pos++ < input.size();
+    }
+
+    static bool parseValue(const string& input, size_t& pos, JsonValue& value) {
+        skipSpace(input, pos);
+        if (pos >= input.size()) {
+            return false;
+        }
+        char c = input[pos];
+        if (c == '{') {
+            value.type = Type::Object;
+            pos++;
+            skipSpace(input, pos);
+            if (pos < input.size() && input[pos] == '}') {
+                pos++;
+                return true;
+            }
+            while (true) {
+                string key;
+                JsonValue member;
+                skipSpace(input, pos);
+                if (!parseString(input, pos, key)) {
+                    return false;
+                }
+                skipSpace(input, pos);
+                if (pos >= input.size() || input[pos++] != ':' || !parseValue(input, pos, member)) {
+                    return false;
+                }
+                value.members.emplace_back(move(key), move(member));
+                skipSpace(input, pos);
+                if (pos < input.size() && input[pos] == ',') {
+                    pos++;
+                } else {
+                    return pos < input.size() && input[pos++] == '}';
+                }
+            }
+        }
+        if (c == '[') {
+            value.type = Type::Array;
+            pos++;
+            skipSpace(input, pos);
+            if (pos < input.size() && input[pos] == ']') {
+                pos++;
+                return true;
+            }
+            while (true) {
+                JsonValue item;
+                if (!parseValue(input, pos, item)) {
+                    return false;
+                }
+                value.items.push_back(move(item));
+                skipSpace(input, pos);
+                if (pos < input.size() && input[pos] == ',') {
+                    pos++;
+                } else {
+                    return pos < input.size() && input[pos++] == ']';
+                }
+            }
+        }
+        if (c == '"') {
+            value.type = Type::String;
+            return parseString(input, pos, value.text);
+        }
+        for (const char* word : { "true", "false", "null" }) {
+            if (input.compare(pos, strlen(word), word) == 0) {
+                value.type = (*word == 'n') ? Type::Null : Type::Boolean;
+                value.number = (*word == 't') ? 1 : 0;
+                pos += strlen(word);
+                return true;
+            }
+        }
+        char* end;
+        value.type = Type::Number;
+        value.number = strtod(input.c_str() + pos, &end);
+        if (end == input.c_str() + pos) {
+            return false;
+        }
+        pos = end - input.c_str();
+        return true;
     }
 };
 
-int main() {
+static bool loadBenchmarkJson(const char* path, vector<BenchmarkResult>& results) {
+    ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    stringstream contents;
+    contents << file.rdbuf();
+    JsonValue root;
+    const JsonValue* entries = nullptr;
+    if (!JsonValue::parse(contents.str(), root) || !(entries = root.find("results")) ||
+        entries->type != JsonValue::Type::Array) {
+        cerr << path << ": not a benchmark results file" << endl;
+        return false;
+    }
+    for (const JsonValue& entry : entries->items) {
+        const JsonValue* name = entry.find("name");
+        const JsonValue* profile = entry.find("profile");
+        const JsonValue* bytes = entry.find("bytes");
+        const JsonValue* seconds = entry.find("seconds");
+        if (!name || !profile || !bytes || !seconds || seconds->type != JsonValue::Type::Array) {
+            continue;
+        }
+        BenchmarkResult result;
+        result.name = name->text;
+        result.profile = profile->text;
+        result.bytes = static_cast<size_t>(bytes->number);
+        for (const JsonValue& value : seconds->items) {
+            result.seconds.push_back(value.number);
+        }
+        if (const JsonValue* peak = entry.find("peak_resident")) {
+            result.peakResident = static_cast<size_t>(peak->number);
+        }
+        if (const JsonValue* operations = entry.find("operations")) {
+            result.operations = static_cast<size_t>(operations->number);
+        }
+        if (!result.seconds.empty()) {
+            results.push_back(move(result));
+        }
+    }
+    return true;
+}
+
+// Replaces the baseline entries measured again in results and adds the new ones, so one file
+// can hold baselines for several input profiles and sizes.
+static void mergeIntoBaseline(vector<BenchmarkResult>& baseline, const vector<BenchmarkResult>& results) {
+    for (const BenchmarkResult& result : results) {
+        auto existing = find_if(baseline.begin(), baseline.end(), [&](const BenchmarkResult& entry) {
+            return entry.sameBenchmark(result);
+        });
+        if (existing != baseline.end()) {
+            *existing = result;
+        } else {
+            baseline.push_back(result);
+        }
+    }
+}
+
+// A benchmark regresses when its median time grows by more than threshold (a fraction) and
+// the growth is also larger than three times the combined spread (MAD scaled to a standard
+// deviation) of both runs, so noisy cases do not fail the gate. Returns false on regression.
+static bool compareWithBaseline(const vector<BenchmarkResult>& results, const vector<BenchmarkResult>& baseline,
+                                double threshold, ostream& report) {
+    char row[200];
+    snprintf(row, sizeof(row), "%-48s %12s %10s %10s %9s  %s", "benchmark", "bytes", "base rate", "new rate", "change",
+             "verdict");
+    report << row << endl;
+    int regressions = 0;
+    for (const BenchmarkResult& result : results) {
+        auto base = find_if(baseline.begin(), baseline.end(), [&](const BenchmarkResult& entry) {
+            return entry.sameBenchmark(result);
+        });
+        double newSeconds = max(result.medianSeconds(), 1e-9);
+        if (base == baseline.end()) {
+            snprintf(row, sizeof(row), "%-48s %12zu %10s %10s %9s  %s", result.name.c_str(), result.bytes, "-",
+                     result.formatRate(newSeconds).c_str(), "-", "no baseline");
+            report << row << endl;
+            continue;
+        }
+        double baseSeconds = max(base->medianSeconds(), 1e-9);
+        double noise = 3 * 1.4826 * hypot(base->madSeconds(), result.madSeconds());
+        double change = newSeconds / baseSeconds - 1;
+        const char* verdict = "ok";
+        if (change > threshold && newSeconds - baseSeconds > noise) {
+            verdict = "REGRESSED";
+            regressions++;
+        } else if (change > threshold) {
+            verdict = "slower, within noise";
+        } else if (-change > threshold && baseSeconds - newSeconds > noise) {
+            verdict = "improved";
+        }
+        snprintf(row, sizeof(row), "%-48s %12zu %10s %10s %+8.1f%%  %s", result.name.c_str(), result.bytes,
+                 base->formatRate(baseSeconds).c_str(), result.formatRate(newSeconds).c_str(),
+                 -100.0 * change / (1 + change), verdict);
+        report << row << endl;
+    }
+    report << regressions << " regression(s) beyond " << threshold * 100 << "% throughput loss" << endl;
+    return regressions == 0;
+}
+
+static void printBenchmarkUsage(const char* program) {
+    cerr << "Usage: " << program << " [--min-size SIZE] [--max-size SIZE] [--repeat N] [--filter TEXT] [--json FILE]\n"
+         << "       [--line-length N] [--vocabulary N] [--punctuation RATE] [--seed N]\n"
+         << "       [--save-baseline FILE] [--baseline FILE] [--threshold PERCENT] [--edits N]\n\n"
+         << "Sizes grow 16-fold from 1K up to 10G within the bounds (default 1K to 64M).\n"
+         << "--save-baseline merges the results into FILE, keyed by benchmark, input profile and size.\n"
+         << "--baseline compares the run with FILE and exits with status 1 if a median throughput\n"
+         << "drops by more than --threshold (default 10) beyond the run-to-run noise; use --repeat 5 or more.\n"
+         << "--filter runs only the benchmarks whose name contains TEXT.\n"
+         << "--edits sets the number of edits the editor benchmark replays (default 1000000). It runs only\n"
+         << "at the 1G size and reports edits per second (M/s) and ns per edit." << endl;
+}
+
+static int runBenchmarkSuite(int argc, char* argv[]) {
+    size_t minSize = 1024;
+    size_t maxSize = 64 << 20;
+    int repetitions = 3;
+    string filter;
+    const char* jsonPath = nullptr;
+    const char* baselinePath = nullptr;
+    const char* saveBaselinePath = nullptr;
+    double threshold = 0.10;
+    size_t editorEdits = 1000000;
+    CorpusOptions options;
+    for (int i = 1; i < argc; ++i) {
+        string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (option == "--min-size" && hasValue && parseByteSize(argv[i + 1], minSize)) {
+            i++;
+        } else if (option == "--max-size" && hasValue && parseByteSize(argv[i + 1], maxSize)) {
+            i++;
+        } else if (option == "--repeat" && hasValue && atoi(argv[i + 1]) > 0) {
+            repetitions = atoi(argv[++i]);
+        } else if (option == "--filter" && hasValue) {
+            filter = argv[++i];
+        } else if (option == "--json" && hasValue) {
+            jsonPath = argv[++i];
+        } else if (option == "--baseline" && hasValue) {
+            baselinePath = argv[++i];
+        } else if (option == "--save-baseline" && hasValue) {
+            saveBaselinePath = argv[++i];
+        } else if (option == "--threshold" && hasValue && atof(argv[i + 1]) > 0) {
+            threshold = atof(argv[++i]) / 100;
+        } else if (option == "--line-length" && hasValue && atoi(argv[i + 1]) > 0) {
+            options.lineLength = atoi(argv[++i]);
+        } else if (option == "--vocabulary" && hasValue && atoi(argv[i + 1]) > 0) {
+            options.vocabulary = atoi(argv[++i]);
+        } else if (option == "--punctuation" && hasValue) {
+            options.punctuationRate = atof(argv[++i]);
+        } else if (option == "--edits" && hasValue && atoi(argv[i + 1]) > 0) {
+            editorEdits = atoi(argv[++i]);
+        } else if (option == "--seed" && hasValue) {
+            options.seed = strtoull(argv[++i], nullptr, 10);
+        } else {
+            printBenchmarkUsage(argv[0]);
+            return option == "--help" ? 0 : 1;
+        }
+    }
+
+    vector<size_t> sizes;
+    for (size_t bytes = 1024; bytes <= (10ULL << 30); bytes *= 16) {
+        if (bytes >= minSize && bytes <= maxSize) {
+            sizes.push_back(bytes);
+        }
+    }
+    if ((10ULL << 30) >= minSize && (10ULL << 30) <= maxSize) {
+        sizes.push_back(10ULL << 30);
+    }
+
+    vector<BenchmarkResult> baseline;
+    if (baselinePath && !loadBenchmarkJson(baselinePath, baseline)) {
+        cerr << "Cannot read baseline " << baselinePath << endl;
+        return 1;
+    }
+
+    BenchmarkSuite suite(editorEdits);
+    vector<BenchmarkResult> results = suite.run(sizes, options, repetitions, filter, cout);
+    if (jsonPath) {
+        ofstream json(jsonPath);
+        writeBenchmarkJson(json, results);
+        if (!json) {
+            cerr << "Cannot write " << jsonPath << endl;
+            return 1;
+        }
+    }
+    if (saveBaselinePath) {
+        vector<BenchmarkResult> saved;
+        if (filesystem::exists(saveBaselinePath) && !loadBenchmarkJson(saveBaselinePath, saved)) {
+            return 1;
+        }
+        mergeIntoBaseline(saved, results);
+        ofstream json(saveBaselinePath);
+        writeBenchmarkJson(json, saved);
+        if (!json) {
+            cerr << "Cannot write " << saveBaselinePath << endl;
+            return 1;
+        }
+    }
+    if (baselinePath) {
+        cout << '\n';
+        return compareWithBaseline(results, baseline, threshold, cout) ? 0 : 1;
+    }
+    return 0;
+}
+#endif
+
+int main(int argc, char* argv[]) {
+#if HW4_BENCHMARK
+    return runBenchmarkSuite(argc, argv);
+#endif
+    if (argc > 1) {
+        return runCommandLine(argc, argv);
+    }
+
     TextFileSource source1("../data1.txt");
     TextFileSource source2("../data2.txt");
     TextConsoleSource source3;
@@ -735,6 +8270,11 @@ int main() {
 
     RemoveString removeString("warlock");
     RemoveLines removeLines("Cataclysm");
+    FilterLines filterLines("^(By|You) .*(fire|hope)");
+    SearchOptions searchOptions;
+    searchOptions.lineNumbers = true;
+    searchOptions.contextLines = 1;
+    SearchLines searchLines("hope", searchOptions);
     RemoveCharacter removeCharacter('t');
     ReplaceString replaceString("hope", "Horde");
     RemovePunctuation removePunctuation;
@@ -744,14 +8284,18 @@ int main() {
     RemoveNewline removeNewline;
     LexSortLines lexSortLines;
     RemoveDuplicateLines removeDuplicateLines;
+    SortUnique sortUnique;
     CountLines countLines;
     CountSymbols countSymbols;
+    CountDistinctLines countDistinctLines;
+    CountDistinctWords countDistinctWords(DistinctMode::Approximate);
     TextTransform* transformations[] = { &removeString,&removeNewline };
     TextTransform* transformations1[] = { &lexSortLines, &replaceString, &removePunctuation };
     TextTransform* transformations2[] = { &removeLines, &addNewlineSentence };
     TextTransform* transformations3[] = { &addNewlineWord, &removeString, &countSymbols };
-    TextTransform* transformations4[] = { &lexSortLines, &removeDuplicateLines, &removeCharacter };
+    TextTransform* transformations4[] = { &sortUnique, &removeCharacter };
     TextTransform* transformations5[] = { &addNewlineMaxChars, &countLines };
+    TextTransform* transformations6[] = { &removePunctuation, &countDistinctWords };
     int numTransformations = (sizeof(transformations) / sizeof(transformations[0]));
 
     TextProcessor processor(sources, numSources, transformations, numTransformations, outputs, numOutputs);
@@ -761,4 +8305,4 @@ int main() {
     processor.process();
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,40 @@
+# Runs a pipeline over more than 1000 lines with and without --optimize and fails if the
+# outputs differ. RemoveDuplicateLines keeps at most 1000 lines, so the optimizer must not
+# move the filter in front of it or drop it before SortUnique.
+# Usage: cmake -DHW4=<hw4 binary> -DWORK_DIR=<scratch dir> -P optimizer_line_limit.cmake
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+set(input "")
+foreach(i RANGE 1 1500)
+    math(EXPR third "${i} % 3")
+    if(third EQUAL 0)
+        string(APPEND input "line ${i} ab\n")
+    else()
+        string(APPEND input "line ${i}\n")
+    endif()
+endforeach()
+file(WRITE "${WORK_DIR}/input.txt" "${input}")
+
+foreach(variant plain optimized)
+    set(extra "")
+    if(variant STREQUAL "optimized")
+        set(extra --optimize)
+    endif()
+    execute_process(
+        COMMAND "${HW4}" --source "file input.txt" --transform "RemoveDuplicateLines"
+                --transform "FilterLines ab" --transform "SortUnique"
+                --output "file 1000000 ${variant}" ${extra}
+        WORKING_DIRECTORY "${WORK_DIR}"
+        RESULT_VARIABLE result
+        OUTPUT_QUIET ERROR_QUIET)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "hw4 ${extra} exited with ${result}")
+    endif()
+    file(READ "${WORK_DIR}/${variant}_000.txt" ${variant})
+endforeach()
+
+if(NOT plain STREQUAL optimized)
+    message(FATAL_ERROR "--optimize changed the output of a pipeline over more than 1000 lines")
+endif()